@@ -0,0 +1,393 @@
+// BENCHMARK DRIVER
+//
+// Times parallel_join_impl, or another join entry point (see BENCH_API), on
+// generated inputs (see generate_inputs) and
+// reports the wall time of every join phase (see JoinPhase) as min/avg/max
+// over the ranks. Nothing is printed per row, and there is no sleep, so
+// the numbers are comparable between runs.
+//
+// Build and run (see run.sh):
+//   mpic++ -fPIC -std=c++11 -pthread bench.cpp -o bench.out
+//   mpiexec -n 4 ./bench.out
+//
+// The join itself is configured with the JOIN_* variables (see JoinConfig),
+// the benchmark with:
+//   BENCH_ROWS           comma separated global left table sizes to sweep (default 1M,4M,16M)
+//   BENCH_RIGHT_FACTOR   right table size as a multiple of the left one (default 1)
+//   BENCH_ROWS_PER_RANK  1: BENCH_ROWS are rows per rank, for weak scaling sweeps (default 0)
+//   BENCH_API            join entry point: impl (parallel_join_impl), columns
+//                        (parallel_join_columns over data0 and data1), indices
+//                        (parallel_join_indices, then fetch_column of the right table),
+//                        stream (streaming_join over vector sources), files (streaming_join
+//                        over column files written to JOIN_SPILL_DIR, untimed), count
+//                        (parallel_join_count) or aggregate (parallel_join_aggregate, whose
+//                        output rows are the joined keys) (default impl)
+//   BENCH_DIST           key distribution: uniform, zipf, sequential or clustered (default uniform)
+//   BENCH_ZIPF_S, BENCH_SELECTIVITY, BENCH_DUPLICATION, BENCH_SEED  see GeneratorConfig
+//   BENCH_WARMUP         untimed joins before the timed ones (default 1)
+//   BENCH_REPS           timed joins per size (default 5)
+//   BENCH_FORMAT         csv, or json for one JSON object per line (default csv)
+//   BENCH_OUTPUT         file the records are appended to (default stdout)
+//   BENCH_LABEL          free text copied into every record, e.g. a commit id
+//
+// Every record is one phase of one size: the phase time of every rank is
+// averaged over the repetitions, then reduced to min/avg/max over the ranks.
+// The "total" phase is the time of the whole call, phases do not add up to
+// it exactly (see JoinPhase). A sweep over rank counts appends the runs of
+// several mpiexec calls to the same BENCH_OUTPUT.
+// Built with -DJOIN_STATS, the counters of the last join of every size go
+// to stderr (see print_join_stats), and JOIN_TRACE=<file> writes the phases
+// of all joins as a Chrome trace (see write_join_trace).
+
+#define JOIN_BENCHMARK
+#include "main.cpp"
+
+#include <sstream>
+
+/**
+ * @brief Join entry point timed by the benchmark (BENCH_API).
+ */
+enum BenchApi {
+    BENCH_API_IMPL,
+    BENCH_API_COLUMNS,
+    BENCH_API_INDICES,
+    BENCH_API_STREAM,
+    BENCH_API_FILES,
+    BENCH_API_COUNT,
+    BENCH_API_AGGREGATE
+};
+
+/**
+ * @brief Options of the benchmark, read from the environment.
+ */
+struct BenchConfig {
+    std::vector<int64_t> rows;
+    double right_factor;
+    bool rows_per_rank;
+    BenchApi api;
+    GeneratorConfig generator;
+    int warmup;
+    int reps;
+    bool json;
+    std::string output;
+    std::string label;
+
+    BenchConfig() : right_factor(1.0), rows_per_rank(false), api(BENCH_API_IMPL), warmup(1), reps(5), json(false) {}
+};
+
+/**
+ * @brief Min/avg/max of one value over all ranks (valid on rank 0).
+ */
+struct RankStats {
+    double min;
+    double avg;
+    double max;
+};
+
+/**
+ * @brief Name of a JOIN_ENGINE value.
+ */
+static const char *engine_name(JoinEngine engine)
+{
+    switch (engine) {
+    case JOIN_ENGINE_HASH:
+        return "hash";
+    case JOIN_ENGINE_RADIX:
+        return "radix";
+    case JOIN_ENGINE_SORT_MERGE:
+        return "sort_merge";
+    case JOIN_ENGINE_DENSE:
+        return "dense";
+    default:
+        return "auto";
+    }
+}
+
+/**
+ * @brief Name of a BENCH_API value.
+ */
+static const char *api_name(BenchApi api)
+{
+    switch (api) {
+    case BENCH_API_COLUMNS:
+        return "columns";
+    case BENCH_API_INDICES:
+        return "indices";
+    case BENCH_API_STREAM:
+        return "stream";
+    case BENCH_API_FILES:
+        return "files";
+    case BENCH_API_COUNT:
+        return "count";
+    case BENCH_API_AGGREGATE:
+        return "aggregate";
+    default:
+        return "impl";
+    }
+}
+
+/**
+ * @brief Name of a BENCH_DIST value.
+ */
+static const char *distribution_name(KeyDistribution distribution)
+{
+    switch (distribution) {
+    case KEYS_ZIPF:
+        return "zipf";
+    case KEYS_SEQUENTIAL:
+        return "sequential";
+    case KEYS_CLUSTERED:
+        return "clustered";
+    default:
+        return "uniform";
+    }
+}
+
+/**
+ * @brief Parse a comma separated list of row counts.
+ */
+static std::vector<int64_t> parse_rows(const std::string &list)
+{
+    std::vector<int64_t> rows;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty())
+            rows.push_back(strtoll(item.c_str(), NULL, 10));
+    }
+    return rows;
+}
+
+/**
+ * @brief Read the benchmark options from the BENCH_* environment variables.
+ */
+static BenchConfig load_bench_config()
+{
+    BenchConfig config;
+    config.rows = parse_rows(env_string("BENCH_ROWS", "1048576,4194304,16777216"));
+    config.right_factor = env_double("BENCH_RIGHT_FACTOR", config.right_factor);
+    config.rows_per_rank = env_int64("BENCH_ROWS_PER_RANK", config.rows_per_rank) != 0;
+
+    std::string api = env_string("BENCH_API", "impl");
+    if (api == "columns")
+        config.api = BENCH_API_COLUMNS;
+    else if (api == "indices")
+        config.api = BENCH_API_INDICES;
+    else if (api == "stream")
+        config.api = BENCH_API_STREAM;
+    else if (api == "files")
+        config.api = BENCH_API_FILES;
+    else if (api == "count")
+        config.api = BENCH_API_COUNT;
+    else if (api == "aggregate")
+        config.api = BENCH_API_AGGREGATE;
+    else if (api != "impl" && rank == 0)
+        std::cerr << "Unknown BENCH_API '" << api << "', using impl" << std::endl;
+
+    std::string dist = env_string("BENCH_DIST", "uniform");
+    if (dist == "zipf")
+        config.generator.distribution = KEYS_ZIPF;
+    else if (dist == "sequential")
+        config.generator.distribution = KEYS_SEQUENTIAL;
+    else if (dist == "clustered")
+        config.generator.distribution = KEYS_CLUSTERED;
+    else if (dist != "uniform" && rank == 0)
+        std::cerr << "Unknown BENCH_DIST '" << dist << "', using uniform" << std::endl;
+    config.generator.zipf_s = env_double("BENCH_ZIPF_S", config.generator.zipf_s);
+    config.generator.selectivity = env_double("BENCH_SELECTIVITY", config.generator.selectivity);
+    config.generator.duplication = env_double("BENCH_DUPLICATION", config.generator.duplication);
+    config.generator.seed = env_int64("BENCH_SEED", config.generator.seed);
+    config.generator.threads = join_config.threads;
+
+    config.warmup = std::max<int64_t>(0, env_int64("BENCH_WARMUP", config.warmup));
+    config.reps = std::max<int64_t>(1, env_int64("BENCH_REPS", config.reps));
+    std::string format = env_string("BENCH_FORMAT", "csv");
+    config.json = format == "json";
+    if (format != "csv" && format != "json" && rank == 0)
+        std::cerr << "Unknown BENCH_FORMAT '" << format << "', using csv" << std::endl;
+    config.output = env_string("BENCH_OUTPUT", "");
+    config.label = env_string("BENCH_LABEL", "");
+    return config;
+}
+
+/**
+ * @brief Reduce a per-rank value to its min/avg/max over all ranks on rank 0.
+ */
+static RankStats reduce_stats(double value)
+{
+    RankStats stats;
+    double sum = 0;
+    MPI_Reduce(&value, &stats.min, 1, MPI_DOUBLE, MPI_MIN, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&value, &stats.max, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&value, &sum, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    stats.avg = sum / n_pes;
+    return stats;
+}
+
+/**
+ * @brief Path of the column file of one input column (BENCH_API=files).
+ */
+static std::string bench_column_path(const char *column)
+{
+    return join_config.spill_dir + "/bench_" + column + ".col";
+}
+
+/**
+ * @brief Stream the join of two sources, only counting the output batches
+ * as a consumer would process them.
+ *
+ * @return int64_t Number of output rows on this rank
+ */
+static int64_t stream_rows(LeftBatchSource left, RightBatchSource right)
+{
+    int64_t rows = 0;
+    streaming_join(left, right, [&rows](const std::vector<int> &keys, const std::vector<double> &,
+                                        const std::vector<int> &) { rows += keys.size(); });
+    return rows;
+}
+
+/**
+ * @brief Run one join of the tables through the entry point of `api`.
+ *
+ * @return int64_t Number of output rows on this rank
+ */
+static int64_t run_join(BenchApi api, const std::vector<int> &k1, const std::vector<int> &k2,
+                        const std::vector<double> &d1, const std::vector<int> &d2)
+{
+    switch (api) {
+    case BENCH_API_COLUMNS:
+        return std::get<0>(parallel_join_columns(k1, k2, d1, d2)).size();
+    case BENCH_API_INDICES: {
+        std::vector<int64_t> right_ids = std::get<1>(parallel_join_indices(k1, k2, false));
+        fetch_column(k2, right_ids);
+        fetch_column(d1, right_ids);
+        fetch_column(d2, right_ids);
+        return right_ids.size();
+    }
+    case BENCH_API_STREAM:
+        return stream_rows(vector_left_source(k1), vector_right_source(k2, d1, d2));
+    case BENCH_API_FILES:
+        return stream_rows(column_left_source(bench_column_path("keys1")),
+                           column_right_source(bench_column_path("keys2"), bench_column_path("data0"),
+                                               bench_column_path("data1")));
+    case BENCH_API_COUNT: {
+        // The count is global, rank 0 reports it all
+        int64_t rows = parallel_join_count(k1, k2);
+        return rank == 0 ? rows : 0;
+    }
+    case BENCH_API_AGGREGATE:
+        return parallel_join_aggregate(k1, k2, d1, d2).size();
+    default:
+        return std::get<0>(parallel_join_impl(k1, k2, d1, d2)).size();
+    }
+}
+
+/**
+ * @brief Write one record (rank 0 only).
+ */
+static void write_record(FILE *out, const BenchConfig &config, int64_t left_rows, int64_t right_rows,
+                         int64_t output_rows, const char *phase, const RankStats &stats)
+{
+    const char *dist = distribution_name(config.generator.distribution);
+    const char *engine = engine_name(join_config.engine);
+    const char *api = api_name(config.api);
+    if (config.json)
+        fprintf(out,
+                "{\"label\": \"%s\", \"ranks\": %d, \"threads\": %d, \"engine\": \"%s\", \"api\": \"%s\", "
+                "\"distribution\": \"%s\", \"left_rows\": %lld, \"right_rows\": %lld, \"output_rows\": %lld, "
+                "\"reps\": %d, \"phase\": \"%s\", \"min_s\": %.9f, \"avg_s\": %.9f, \"max_s\": %.9f}\n",
+                config.label.c_str(), n_pes, join_config.threads, engine, api, dist, (long long)left_rows,
+                (long long)right_rows, (long long)output_rows, config.reps, phase, stats.min, stats.avg, stats.max);
+    else
+        fprintf(out, "%s,%d,%d,%s,%s,%s,%lld,%lld,%lld,%d,%s,%.9f,%.9f,%.9f\n", config.label.c_str(), n_pes,
+                join_config.threads, engine, api, dist, (long long)left_rows, (long long)right_rows,
+                (long long)output_rows, config.reps, phase, stats.min, stats.avg, stats.max);
+}
+
+int main()
+{
+    int thread_support;
+    MPI_Init_thread(NULL, NULL, MPI_THREAD_FUNNELED, &thread_support);
+    MPI_Comm_size(MPI_COMM_WORLD, &n_pes);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    load_join_config();
+    if (thread_support < MPI_THREAD_FUNNELED)
+        join_config.threads = 1;
+    BenchConfig config = load_bench_config();
+
+    // Records are appended, the CSV header only goes to new or empty files
+    FILE *out = NULL;
+    if (rank == 0) {
+        out = config.output.empty() ? stdout : fopen(config.output.c_str(), "a");
+        if (out == NULL) {
+            perror(config.output.c_str());
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        fseek(out, 0, SEEK_END);
+        if (!config.json && ftell(out) <= 0)
+            fprintf(out, "label,ranks,threads,engine,api,distribution,left_rows,right_rows,output_rows,reps,"
+                         "phase,min_s,avg_s,max_s\n");
+    }
+
+    for (size_t r = 0; r < config.rows.size(); r++) {
+        GeneratorConfig generator = config.generator;
+        generator.left_rows = config.rows[r] * (config.rows_per_rank ? n_pes : 1);
+        generator.right_rows = int64_t(generator.left_rows * config.right_factor);
+        std::vector<int> k1, k2, d2;
+        std::vector<double> d1;
+        generate_inputs(generator, k1, k2, d1, d2, rank, n_pes);
+        if (config.api == BENCH_API_FILES) {
+            write_column(bench_column_path("keys1"), k1);
+            write_column(bench_column_path("keys2"), k2);
+            write_column(bench_column_path("data0"), d1);
+            write_column(bench_column_path("data1"), d2);
+        }
+
+        std::vector<double> phase_sum(N_JOIN_PHASES, 0.0);
+        double total_sum = 0;
+        int64_t output_rows = 0;
+        for (int rep = -config.warmup; rep < config.reps; rep++) {
+            reset_join_phases();
+            reset_join_stats();
+            MPI_Barrier(MPI_COMM_WORLD);
+            double start = MPI_Wtime();
+            int64_t rows = run_join(config.api, k1, k2, d1, d2);
+            double seconds = MPI_Wtime() - start;
+            if (rep < 0)
+                continue;
+            for (int p = 0; p < N_JOIN_PHASES; p++)
+                phase_sum[p] += join_phase_seconds[p];
+            total_sum += seconds;
+            output_rows = rows;
+        }
+
+        if (config.api == BENCH_API_FILES) {
+            MPI_Barrier(MPI_COMM_WORLD);
+            if (rank == 0) {
+                unlink(bench_column_path("keys1").c_str());
+                unlink(bench_column_path("keys2").c_str());
+                unlink(bench_column_path("data0").c_str());
+                unlink(bench_column_path("data1").c_str());
+            }
+        }
+
+        int64_t global_output_rows = 0;
+        MPI_Reduce(&output_rows, &global_output_rows, 1, MPI_INT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+        for (int p = 0; p <= N_JOIN_PHASES; p++) {
+            double seconds = p < N_JOIN_PHASES ? phase_sum[p] : total_sum;
+            RankStats stats = reduce_stats(seconds / config.reps);
+            if (rank == 0)
+                write_record(out, config, generator.left_rows, generator.right_rows, global_output_rows,
+                             p < N_JOIN_PHASES ? JOIN_PHASE_NAMES[p] : "total", stats);
+        }
+        if (rank == 0)
+            fflush(out);
+        print_join_stats(stderr);
+    }
+    write_join_trace();
+
+    if (out != NULL && out != stdout)
+        fclose(out);
+    release_node_shuffle();
+    MPI_Finalize();
+}
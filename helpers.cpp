@@ -4,6 +4,11 @@
 #include <algorithm>
 #include "unistd.h"
 #include <tuple>
+#include <cstddef>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <thread>
 #include "mpi.h"
 
 // MPI HELPER FUNCTIONS
@@ -151,6 +156,52 @@ double allreduce_sum_scalar(double val)
     return ret;
 }
 
+/**
+ * @brief Same as allreduce_sum_scalar, except for summing a whole int64_t
+ * buffer element-wise.
+ *
+ * @param send_buffer This rank's values (`count` elements)
+ * @param[out] recv_buffer Global sums (`count` elements)
+ * @param count Number of elements
+ */
+void allreduce_sum_int64(int64_t *send_buffer, int64_t *recv_buffer, int count)
+{
+    MPI_Allreduce(send_buffer, recv_buffer, count, MPI_LONG_LONG_INT, MPI_SUM, MPI_COMM_WORLD);
+}
+
+/**
+ * @brief Helper function around MPI_Allreduce computing the bitwise OR of
+ * a uint64_t buffer over all ranks, in place.
+ *
+ * @param[in,out] buffer This rank's values, replaced by the global OR (`count` elements)
+ * @param count Number of elements
+ */
+void allreduce_bor_uint64(uint64_t *buffer, int count)
+{
+    MPI_Allreduce(MPI_IN_PLACE, buffer, count, MPI_UINT64_T, MPI_BOR, MPI_COMM_WORLD);
+}
+
+/**
+ * @brief Helper function around MPI_Allgather: every rank contributes
+ * `count` ints and receives the contributions of all ranks.
+ *
+ * @param send_buffer This rank's values (`count` elements)
+ * @param count Number of elements contributed by every rank
+ * @param[out] recv_buffer Values of all ranks, ordered by rank (`count * n_pes` elements)
+ */
+void allgather_int(int *send_buffer, int count, int *recv_buffer)
+{
+    MPI_Allgather(send_buffer, count, MPI_INT, recv_buffer, count, MPI_INT, MPI_COMM_WORLD);
+}
+
+/**
+ * @brief Same as allgather_int, except for int64_t values.
+ */
+void allgather_int64(int64_t *send_buffer, int count, int64_t *recv_buffer)
+{
+    MPI_Allgather(send_buffer, count, MPI_LONG_LONG_INT, recv_buffer, count, MPI_LONG_LONG_INT, MPI_COMM_WORLD);
+}
+
 /**
  * @brief Helper function to send an int from this rank to every other rank
  * using MPI_Alltoall
@@ -197,6 +248,318 @@ void alltoallv_double(double *send_buffer, std::vector<int> &send_counts, std::v
                   recv_buffer, recv_counts.data(), recv_disp.data(), MPI_DOUBLE, MPI_COMM_WORLD);
 }
 
+/**
+ * @brief One row of the right table (key, data0, data1) packed for shuffling.
+ * Fields are ordered so that the struct has no padding.
+ */
+struct JoinRow {
+    int key;
+    int data1;
+    double data0;
+};
+
+/**
+ * @brief Get the committed MPI datatype describing a JoinRow.
+ * The type is created on first use and reused afterwards.
+ *
+ * @return MPI_Datatype Datatype for one JoinRow
+ */
+MPI_Datatype join_row_type()
+{
+    static MPI_Datatype row_type = MPI_DATATYPE_NULL;
+    if (row_type == MPI_DATATYPE_NULL) {
+        int block_lengths[3] = {1, 1, 1};
+        MPI_Aint displacements[3] = {offsetof(JoinRow, key), offsetof(JoinRow, data1), offsetof(JoinRow, data0)};
+        MPI_Datatype types[3] = {MPI_INT, MPI_INT, MPI_DOUBLE};
+        MPI_Datatype tmp_type;
+        MPI_Type_create_struct(3, block_lengths, displacements, types, &tmp_type);
+        MPI_Type_create_resized(tmp_type, 0, sizeof(JoinRow), &row_type);
+        MPI_Type_free(&tmp_type);
+        MPI_Type_commit(&row_type);
+    }
+    return row_type;
+}
+
+// LARGE-COUNT MPI HELPER FUNCTIONS
+
+// largest number of elements sent in one message by the MPI-3 large-count fallback
+static const int64_t LARGE_COUNT_CHUNK = int64_t(1) << 28;
+
+// message tag of the point-to-point large-count fallbacks (not used by any other message)
+static const int LARGE_COUNT_TAG = 0x4c43;
+
+/**
+ * @brief Exchange `count` int64_t values with every rank (MPI_Alltoall).
+ *
+ * @param send_buffer Values to send, `count` per rank, ordered by rank
+ * @param count Number of values sent to every rank
+ * @param[out] recv_buffer Values received, `count` per rank, ordered by rank
+ */
+void alltoall_int64(int64_t *send_buffer, int count, int64_t *recv_buffer)
+{
+    MPI_Alltoall(send_buffer, count, MPI_INT64_T, recv_buffer, count, MPI_INT64_T, MPI_COMM_WORLD);
+}
+
+/**
+ * @brief Check whether all values of a count/displacement vector fit in an int.
+ */
+static bool fits_int(const std::vector<int64_t> &values)
+{
+    for (size_t i = 0; i < values.size(); i++) {
+        if (values[i] > INT_MAX)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Alltoallv with 64-bit counts and displacements (in elements of `type`).
+ * If every count and displacement of every rank fits in an int this is a
+ * plain MPI_Alltoallv. Otherwise MPI_Alltoallv_c is used on MPI-4 runtimes,
+ * and on MPI-3 runtimes every rank pair exchanges its data with
+ * point-to-point messages of at most LARGE_COUNT_CHUNK elements, addressed
+ * with 64-bit pointer offsets. The path is agreed on with an MPI_Allreduce,
+ * since a single rank with a large count must not leave the others in a
+ * collective it does not call.
+ *
+ * @param send_buffer Buffer with data to send to all ranks, ordered by destination rank
+ * @param send_counts Number of elements to send to each rank (length `n_pes`)
+ * @param send_disp Displacement of the data for each rank in `send_buffer` (length `n_pes`)
+ * @param[out] recv_buffer Buffer to copy the data into. Make sure that it is appropriately sized.
+ * @param recv_counts Number of elements to receive from each rank (length `n_pes`)
+ * @param recv_disp Displacement in `recv_buffer` of the data from each rank (length `n_pes`)
+ * @param type MPI datatype of the elements
+ * @param comm Communicator to exchange over (counts are per rank of `comm`)
+ */
+void alltoallv_large(void *send_buffer, std::vector<int64_t> &send_counts, std::vector<int64_t> &send_disp,
+                     void *recv_buffer, std::vector<int64_t> &recv_counts, std::vector<int64_t> &recv_disp,
+                     MPI_Datatype type, MPI_Comm comm = MPI_COMM_WORLD)
+{
+    int large = !(fits_int(send_counts) && fits_int(send_disp) && fits_int(recv_counts) && fits_int(recv_disp));
+    MPI_Allreduce(MPI_IN_PLACE, &large, 1, MPI_INT, MPI_LOR, comm);
+    if (!large) {
+        std::vector<int> sc(send_counts.begin(), send_counts.end());
+        std::vector<int> sd(send_disp.begin(), send_disp.end());
+        std::vector<int> rc(recv_counts.begin(), recv_counts.end());
+        std::vector<int> rd(recv_disp.begin(), recv_disp.end());
+        MPI_Alltoallv(send_buffer, sc.data(), sd.data(), type,
+                      recv_buffer, rc.data(), rd.data(), type, comm);
+        return;
+    }
+
+#if MPI_VERSION >= 4
+    std::vector<MPI_Count> sc(send_counts.begin(), send_counts.end());
+    std::vector<MPI_Aint> sd(send_disp.begin(), send_disp.end());
+    std::vector<MPI_Count> rc(recv_counts.begin(), recv_counts.end());
+    std::vector<MPI_Aint> rd(recv_disp.begin(), recv_disp.end());
+    MPI_Alltoallv_c(send_buffer, sc.data(), sd.data(), type,
+                    recv_buffer, rc.data(), rd.data(), type, comm);
+#else
+    int n_pes;
+    MPI_Comm_size(comm, &n_pes);
+    MPI_Aint lb, extent;
+    MPI_Type_get_extent(type, &lb, &extent);
+    char *send_bytes = static_cast<char *>(send_buffer);
+    char *recv_bytes = static_cast<char *>(recv_buffer);
+
+    std::vector<MPI_Request> requests;
+    for (int p = 0; p < n_pes; p++) {
+        for (int64_t off = 0; off < recv_counts[p]; off += LARGE_COUNT_CHUNK) {
+            requests.push_back(MPI_REQUEST_NULL);
+            MPI_Irecv(recv_bytes + (recv_disp[p] + off) * extent, (int)std::min(LARGE_COUNT_CHUNK, recv_counts[p] - off),
+                      type, p, LARGE_COUNT_TAG, comm, &requests.back());
+        }
+    }
+    for (int p = 0; p < n_pes; p++) {
+        for (int64_t off = 0; off < send_counts[p]; off += LARGE_COUNT_CHUNK) {
+            requests.push_back(MPI_REQUEST_NULL);
+            MPI_Isend(send_bytes + (send_disp[p] + off) * extent, (int)std::min(LARGE_COUNT_CHUNK, send_counts[p] - off),
+                      type, p, LARGE_COUNT_TAG, comm, &requests.back());
+        }
+    }
+    MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+#endif
+}
+
+/**
+ * @brief Exchange the element count of every rank with MPI_Allgather, and
+ * lay out the elements of all ranks one after the other, in rank order.
+ *
+ * @param count Number of elements of this rank
+ * @param[out] counts Number of elements of each rank (length `n_pes`)
+ * @param[out] disp Displacement of the elements of each rank (length `n_pes`)
+ * @return int64_t Total number of elements of all ranks
+ */
+int64_t allgather_layout(int64_t count, std::vector<int64_t> &counts, std::vector<int64_t> &disp)
+{
+    int n_pes;
+    MPI_Comm_size(MPI_COMM_WORLD, &n_pes);
+    counts.resize(n_pes);
+    disp.assign(n_pes, 0);
+    MPI_Allgather(&count, 1, MPI_INT64_T, counts.data(), 1, MPI_INT64_T, MPI_COMM_WORLD);
+    for (int p = 1; p < n_pes; p++)
+        disp[p] = disp[p - 1] + counts[p - 1];
+    return disp[n_pes - 1] + counts[n_pes - 1];
+}
+
+/**
+ * @brief Allgatherv with 64-bit counts and displacements (in elements of `type`).
+ * Every rank has the same counts, so every rank takes the same path: a plain
+ * MPI_Allgatherv if they all fit in an int, MPI_Allgatherv_c on MPI-4
+ * runtimes, and on MPI-3 runtimes every rank broadcasts its elements from
+ * their place in `recv_buffer`, in messages of at most LARGE_COUNT_CHUNK elements.
+ *
+ * @param send_buffer This rank's elements
+ * @param send_count Number of elements of this rank
+ * @param[out] recv_buffer Elements of all ranks, ordered by rank. Make sure that it is appropriately sized.
+ * @param recv_counts Number of elements of each rank (length `n_pes`, see allgather_layout)
+ * @param recv_disp Displacement in `recv_buffer` of the elements of each rank (length `n_pes`)
+ * @param type MPI datatype of the elements (without holes, as they may be copied bytewise)
+ */
+void allgatherv_large(const void *send_buffer, int64_t send_count, void *recv_buffer,
+                      std::vector<int64_t> &recv_counts, std::vector<int64_t> &recv_disp, MPI_Datatype type)
+{
+    if (fits_int(recv_counts) && fits_int(recv_disp)) {
+        std::vector<int> rc(recv_counts.begin(), recv_counts.end());
+        std::vector<int> rd(recv_disp.begin(), recv_disp.end());
+        MPI_Allgatherv(send_buffer, (int)send_count, type, recv_buffer, rc.data(), rd.data(), type, MPI_COMM_WORLD);
+        return;
+    }
+
+#if MPI_VERSION >= 4
+    std::vector<MPI_Count> rc(recv_counts.begin(), recv_counts.end());
+    std::vector<MPI_Aint> rd(recv_disp.begin(), recv_disp.end());
+    MPI_Allgatherv_c(send_buffer, send_count, type, recv_buffer, rc.data(), rd.data(), type, MPI_COMM_WORLD);
+#else
+    int n_pes, rank;
+    MPI_Comm_size(MPI_COMM_WORLD, &n_pes);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Aint lb, extent;
+    MPI_Type_get_extent(type, &lb, &extent);
+    char *recv_bytes = static_cast<char *>(recv_buffer);
+    if (send_count > 0)
+        std::memcpy(recv_bytes + recv_disp[rank] * extent, send_buffer, send_count * extent);
+    for (int p = 0; p < n_pes; p++) {
+        for (int64_t off = 0; off < recv_counts[p]; off += LARGE_COUNT_CHUNK)
+            MPI_Bcast(recv_bytes + (recv_disp[p] + off) * extent, (int)std::min(LARGE_COUNT_CHUNK, recv_counts[p] - off),
+                      type, p, MPI_COMM_WORLD);
+    }
+#endif
+}
+
+/**
+ * @brief Gatherv to rank 0 with 64-bit counts and displacements (in elements
+ * of `type`). The path is agreed on as in alltoallv_large: a plain
+ * MPI_Gatherv if every count fits in an int, MPI_Gatherv_c on MPI-4
+ * runtimes, and on MPI-3 runtimes point-to-point messages of at most
+ * LARGE_COUNT_CHUNK elements to rank 0.
+ *
+ * @param send_buffer This rank's elements
+ * @param send_count Number of elements of this rank
+ * @param[out] recv_buffer Elements of all ranks, ordered by rank (only used on rank 0)
+ * @param recv_counts Number of elements of each rank (length `n_pes`, only used on rank 0)
+ * @param recv_disp Displacement in `recv_buffer` of the elements of each rank (only used on rank 0)
+ * @param type MPI datatype of the elements (without holes, as they may be copied bytewise)
+ */
+void gatherv_large(const void *send_buffer, int64_t send_count, void *recv_buffer,
+                   std::vector<int64_t> &recv_counts, std::vector<int64_t> &recv_disp, MPI_Datatype type)
+{
+    int n_pes, rank;
+    MPI_Comm_size(MPI_COMM_WORLD, &n_pes);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    int large = send_count > INT_MAX || (rank == 0 && !(fits_int(recv_counts) && fits_int(recv_disp)));
+    MPI_Allreduce(MPI_IN_PLACE, &large, 1, MPI_INT, MPI_LOR, MPI_COMM_WORLD);
+    if (!large) {
+        std::vector<int> rc(recv_counts.begin(), recv_counts.end());
+        std::vector<int> rd(recv_disp.begin(), recv_disp.end());
+        MPI_Gatherv(send_buffer, (int)send_count, type, recv_buffer, rc.data(), rd.data(), type, 0, MPI_COMM_WORLD);
+        return;
+    }
+
+#if MPI_VERSION >= 4
+    std::vector<MPI_Count> rc(recv_counts.begin(), recv_counts.end());
+    std::vector<MPI_Aint> rd(recv_disp.begin(), recv_disp.end());
+    MPI_Gatherv_c(send_buffer, send_count, type, recv_buffer, rc.data(), rd.data(), type, 0, MPI_COMM_WORLD);
+#else
+    MPI_Aint lb, extent;
+    MPI_Type_get_extent(type, &lb, &extent);
+    const char *send_bytes = static_cast<const char *>(send_buffer);
+    char *recv_bytes = static_cast<char *>(recv_buffer);
+    std::vector<MPI_Request> requests;
+    if (rank == 0) {
+        if (send_count > 0)
+            std::memcpy(recv_bytes + recv_disp[0] * extent, send_buffer, send_count * extent);
+        for (int p = 1; p < n_pes; p++) {
+            for (int64_t off = 0; off < recv_counts[p]; off += LARGE_COUNT_CHUNK) {
+                requests.push_back(MPI_REQUEST_NULL);
+                MPI_Irecv(recv_bytes + (recv_disp[p] + off) * extent, (int)std::min(LARGE_COUNT_CHUNK, recv_counts[p] - off),
+                          type, p, LARGE_COUNT_TAG, MPI_COMM_WORLD, &requests.back());
+            }
+        }
+    } else {
+        for (int64_t off = 0; off < send_count; off += LARGE_COUNT_CHUNK) {
+            requests.push_back(MPI_REQUEST_NULL);
+            MPI_Isend(send_bytes + off * extent, (int)std::min(LARGE_COUNT_CHUNK, send_count - off),
+                      type, 0, LARGE_COUNT_TAG, MPI_COMM_WORLD, &requests.back());
+        }
+    }
+    MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+#endif
+}
+
+/**
+ * @brief Helper function around MPI_Allgatherv with 64-bit counts and
+ * displacements (see allgatherv_large): every rank contributes a variable
+ * number of ints and receives the ints of all ranks.
+ *
+ * @param send_buffer This rank's values
+ * @param send_count Number of values contributed by this rank
+ * @param[out] recv_buffer Values of all ranks, ordered by rank. Make sure that it is
+ * appropriately sized.
+ * @param recv_counts Vector with the number of values contributed by each rank
+ * @param recv_disp Vector with the displacement in `recv_buffer` of each rank's values
+ */
+void allgatherv_int(const int *send_buffer, int64_t send_count, int *recv_buffer,
+                    std::vector<int64_t> &recv_counts, std::vector<int64_t> &recv_disp)
+{
+    allgatherv_large(send_buffer, send_count, recv_buffer, recv_counts, recv_disp, MPI_INT);
+}
+
+/**
+ * @brief Helper function around MPI_Allgatherv for right table rows, with
+ * 64-bit counts and displacements (see allgatherv_large): every rank
+ * contributes a variable number of rows and receives the rows of all ranks.
+ *
+ * @param send_buffer This rank's rows
+ * @param send_count Number of rows contributed by this rank
+ * @param[out] recv_buffer Rows of all ranks, ordered by rank. Make sure that it is
+ * appropriately sized.
+ * @param recv_counts Vector with the number of rows contributed by each rank
+ * @param recv_disp Vector with the displacement in `recv_buffer` of each rank's rows
+ */
+void allgatherv_row(JoinRow *send_buffer, int64_t send_count, JoinRow *recv_buffer,
+                    std::vector<int64_t> &recv_counts, std::vector<int64_t> &recv_disp)
+{
+    allgatherv_large(send_buffer, send_count, recv_buffer, recv_counts, recv_disp, join_row_type());
+}
+
+/**
+ * @brief Helper function around MPI_Gatherv for doubles, with 64-bit counts
+ * and displacements (see gatherv_large): every rank contributes a variable
+ * number of values, which are collected on rank 0.
+ *
+ * @param send_buffer This rank's values
+ * @param send_count Number of values contributed by this rank
+ * @param[out] recv_buffer Values of all ranks, ordered by rank (only used on rank 0).
+ * Make sure that it is appropriately sized.
+ * @param recv_counts Vector with the number of values contributed by each rank (rank 0)
+ * @param recv_disp Vector with the displacement in `recv_buffer` of each rank's values (rank 0)
+ */
+void gatherv_double(double *send_buffer, int64_t send_count, double *recv_buffer,
+                    std::vector<int64_t> &recv_counts, std::vector<int64_t> &recv_disp)
+{
+    gatherv_large(send_buffer, send_count, recv_buffer, recv_counts, recv_disp, MPI_DOUBLE);
+}
 
 // INPUT GENERATORS
 
@@ -228,3 +591,152 @@ void generate_example_inputs(std::vector<int>& keys1, std::vector<int>& keys2, s
     std::vector<int> data1_global = { 4, 1, 2, 3, 0, 5 };
     data1 = {data1_global.begin() + get_start(right_table_size, n_pes, rank), data1_global.begin() + get_end(right_table_size, n_pes, rank)};
 }
+
+/**
+ * @brief Key distributions of generate_inputs.
+ */
+enum KeyDistribution {
+    KEYS_UNIFORM,    // every distinct key equally likely
+    KEYS_ZIPF,       // key rank r drawn with probability proportional to 1 / (r + 1)^s
+    KEYS_SEQUENTIAL, // keys in increasing order along the global rows
+    KEYS_CLUSTERED,  // runs of GEN_CLUSTER_ROWS rows drawing from the same narrow key window
+};
+
+// rows per run, and distinct keys per window, of KEYS_CLUSTERED
+static const int64_t GEN_CLUSTER_ROWS = 64;
+
+/**
+ * @brief Parameters of generate_inputs.
+ */
+struct GeneratorConfig {
+    int64_t left_rows;       // global rows of the left table
+    int64_t right_rows;      // global rows of the right table
+    KeyDistribution distribution;
+    double zipf_s;           // exponent of KEYS_ZIPF
+    double selectivity;      // fraction of left rows whose key is in the right table
+    double duplication;      // average right rows per distinct right key
+    uint64_t seed;
+    int threads;             // threads per rank
+
+    GeneratorConfig()
+        : left_rows(1 << 20), right_rows(1 << 20), distribution(KEYS_UNIFORM), zipf_s(1.0),
+          selectivity(1.0), duplication(1.0), seed(1), threads(1) {}
+};
+
+/**
+ * @brief SplitMix64 finalizer, the stateless random number source of generate_inputs.
+ */
+static inline uint64_t _gen_mix(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+/**
+ * @brief Random 64-bit value for global row `row` of column `stream`.
+ * Every value only depends on (seed, stream, row), so the generated tables
+ * are the same whatever the number of ranks and threads.
+ */
+static inline uint64_t _gen_value(uint64_t seed, uint64_t stream, int64_t row)
+{
+    return _gen_mix(_gen_mix(seed * 0x100000001B3ULL + stream) ^ uint64_t(row));
+}
+
+/**
+ * @brief Uniform double in [0, 1) from a random 64-bit value.
+ */
+static inline double _gen_unit(uint64_t value)
+{
+    return (value >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * @brief Draw a key rank in [0, distinct) for global row `row` of a table with `rows` rows.
+ * Zipf ranks use the inverse CDF of the continuous (bounded Pareto) approximation,
+ * `zipf_span` is (distinct + 1)^(1 - s) - 1 (or log(distinct + 1) if s is 1).
+ */
+static int64_t _gen_key_rank(const GeneratorConfig &config, int64_t distinct, double zipf_span, int64_t rows,
+                             int64_t row, uint64_t value)
+{
+    double u = _gen_unit(value);
+    int64_t r = 0;
+    if (config.distribution == KEYS_UNIFORM) {
+        r = value % distinct;
+    } else if (config.distribution == KEYS_ZIPF) {
+        double x = std::fabs(config.zipf_s - 1.0) < 1e-9
+                       ? std::exp(u * zipf_span)
+                       : std::pow(u * zipf_span + 1.0, 1.0 / (1.0 - config.zipf_s));
+        r = int64_t(x) - 1;
+    } else if (config.distribution == KEYS_SEQUENTIAL) {
+        r = int64_t(double(row) / rows * distinct);
+    } else {
+        int64_t windows = std::max<int64_t>(1, distinct / GEN_CLUSTER_ROWS);
+        int64_t window = _gen_mix(config.seed ^ uint64_t(row / GEN_CLUSTER_ROWS)) % windows;
+        r = window * GEN_CLUSTER_ROWS + int64_t(u * GEN_CLUSTER_ROWS);
+    }
+    return std::min(std::max<int64_t>(r, 0), distinct - 1);
+}
+
+/**
+ * @brief Generate this rank's chunks of a left and a right table for
+ * benchmarking.
+ * The right table has about `right_rows / duplication` distinct keys (even
+ * numbers 2r for key ranks r), drawn with `config.distribution`. A left row
+ * gets a right table key drawn from the same distribution with probability
+ * `selectivity`, and otherwise an odd key that matches nothing. data0 is
+ * uniform in [0, 1) and data1 is the global row index of the right row.
+ * Rows are generated independently from their global index (see
+ * _gen_value), so ranks and threads generate their chunks in parallel and
+ * every run with the same config produces the same global tables.
+ *
+ * @param config Table sizes, key distribution and seed
+ * @param[out] keys1 Left table keys (chunk on this rank)
+ * @param[out] keys2 Right table keys (chunk on this rank)
+ * @param[out] data0 First data column of the right table (chunk on this rank)
+ * @param[out] data1 Second data column of the right table (chunk on this rank)
+ * @param rank This rank
+ * @param n_pes Number of ranks
+ */
+void generate_inputs(const GeneratorConfig &config, std::vector<int> &keys1, std::vector<int> &keys2,
+                     std::vector<double> &data0, std::vector<int> &data1, int rank, int n_pes)
+{
+    const int64_t distinct = std::min<int64_t>(int64_t(1) << 30,
+        std::max<int64_t>(1, int64_t(config.right_rows / std::max(config.duplication, 1e-9))));
+    const double zipf_span = std::fabs(config.zipf_s - 1.0) < 1e-9
+                                 ? std::log(double(distinct + 1))
+                                 : std::pow(double(distinct + 1), 1.0 - config.zipf_s) - 1.0;
+    int64_t left_start = get_start(config.left_rows, n_pes, rank);
+    int64_t right_start = get_start(config.right_rows, n_pes, rank);
+    keys1.resize(get_node_portion(config.left_rows, n_pes, rank));
+    keys2.resize(get_node_portion(config.right_rows, n_pes, rank));
+    data0.resize(keys2.size());
+    data1.resize(keys2.size());
+
+    int n_threads = std::max(1, config.threads);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < n_threads; t++) {
+        threads.push_back(std::thread([&, t]() {
+            int64_t n1 = keys1.size();
+            for (int64_t i = n1 * t / n_threads; i < n1 * (t + 1) / n_threads; i++) {
+                int64_t row = left_start + i;
+                uint64_t value = _gen_value(config.seed, 0, row);
+                if (_gen_unit(_gen_value(config.seed, 1, row)) < config.selectivity)
+                    keys1[i] = int(2 * _gen_key_rank(config, distinct, zipf_span, config.left_rows, row, value));
+                else
+                    keys1[i] = int(2 * (value % distinct) + 1);
+            }
+            int64_t n2 = keys2.size();
+            for (int64_t i = n2 * t / n_threads; i < n2 * (t + 1) / n_threads; i++) {
+                int64_t row = right_start + i;
+                keys2[i] = int(2 * _gen_key_rank(config, distinct, zipf_span, config.right_rows, row,
+                                                 _gen_value(config.seed, 2, row)));
+                data0[i] = _gen_unit(_gen_value(config.seed, 3, row));
+                data1[i] = static_cast<int>(row);
+            }
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++)
+        threads[t].join();
+}
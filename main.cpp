@@ -2,80 +2,5025 @@
 #include <vector>
 #include <random>
 #include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <tuple>
+#include <type_traits>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <limits>
+#include <climits>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "unistd.h"
 #include <mpi.h>
 #include "helpers.cpp"
 
+#ifdef JOIN_USE_LZ4
+#include <lz4.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define JOIN_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
 int rank;
 int n_pes;
 
-// JOIN IMPLEMENTATIONS
+// JOIN CONFIGURATION
+
+/**
+ * @brief Runtime options of the join implementations.
+ * Defaults can be overridden from the environment with load_join_config().
+ */
+enum JoinEngine {
+    JOIN_ENGINE_AUTO,  // pick per call from the input sizes
+    JOIN_ENGINE_HASH,  // single hash table over the right table
+    JOIN_ENGINE_RADIX, // radix partitioned hash join
+    JOIN_ENGINE_SORT_MERGE, // radix sort both sides, then merge
+    JOIN_ENGINE_DENSE, // direct-addressed array over the right key range
+};
+
+enum SimdLevel {
+    SIMD_SCALAR, // one key at a time
+    SIMD_AVX2,   // 8 keys per gather
+    SIMD_AVX512, // 16 keys per gather
+};
+
+enum PartitionHash {
+    PARTITION_MODULO,         // key mod the partition count (non-negative for negative keys)
+    PARTITION_MULTIPLICATIVE, // top bits of a multiplicative hash
+    PARTITION_MURMUR,         // murmur3 64-bit finalizer
+};
+
+struct JoinConfig {
+    bool async_shuffle;          // JOIN_ASYNC_SHUFFLE: pipeline the shuffle with the local join
+    JoinEngine engine;           // JOIN_ENGINE: auto, hash, radix, sort_merge or dense
+    double dense_max_factor;     // JOIN_DENSE_FACTOR: largest right key range, per right row, for which auto uses dense
+    int64_t radix_min_rows;      // JOIN_RADIX_MIN_ROWS: right table size from which auto uses radix
+    int64_t radix_partition_rows; // JOIN_RADIX_PARTITION_ROWS: target right rows per radix partition
+    int threads;                 // JOIN_THREADS: threads per rank for the local join (0: all cores)
+    bool skew_handling;          // JOIN_SKEW: broadcast the right rows of heavy hitter keys
+    double skew_threshold;       // JOIN_SKEW_THRESHOLD: heavy hitter size, as a fraction of the average left rows per rank
+    int64_t skew_sample_rows;    // JOIN_SKEW_SAMPLE_ROWS: left rows sampled per rank to find candidates
+    int64_t broadcast_max_bytes; // JOIN_BROADCAST_MAX_BYTES: largest table replicated instead of shuffled (0: never)
+    bool bloom_filter;           // JOIN_BLOOM: drop left rows absent from a global Bloom filter of the right keys
+    int bloom_bits_per_key;      // JOIN_BLOOM_BITS_PER_KEY: Bloom filter size per right row
+    SimdLevel simd;              // JOIN_SIMD: auto, avx512, avx2 or scalar hash probe (at most what the CPU has)
+    int prefetch_group;          // JOIN_PREFETCH_GROUP: probe keys whose slots are prefetched together (0: off)
+    bool compress_shuffle;       // JOIN_COMPRESS: bit-pack (and LZ4, if built with it) the shuffled partitions
+    int64_t batch_rows;          // JOIN_BATCH_ROWS: rows read per input batch by streaming_join
+    int64_t memory_budget;       // JOIN_MEMORY_BUDGET: bytes of right rows streaming_join keeps in memory before spilling
+    int spill_partitions;        // JOIN_SPILL_PARTITIONS: partition files of a spilled streaming_join
+    std::string spill_dir;       // JOIN_SPILL_DIR: directory of the spill files
+    bool huge_pages;             // JOIN_HUGE_PAGES: back large JoinContext buffers with transparent huge pages
+    std::string trace_file;      // JOIN_TRACE: Chrome trace of the join phases written by write_join_trace (JOIN_STATS builds)
+    bool hierarchical_shuffle;   // JOIN_HIERARCHICAL: shuffle in two levels, through shared memory and node leaders
+    int node_ranks;              // JOIN_NODE_RANKS: largest node of the hierarchical shuffle (0: all ranks sharing memory)
+    PartitionHash partitioner;   // JOIN_PARTITIONER: modulo, multiplicative or murmur hash of the shuffle partitions
+    int partitions;              // JOIN_PARTITIONS: shuffle partitions, assigned to ranks by size if more than n_pes
+    bool pre_aggregate;          // JOIN_PRE_AGGREGATE: collapse the right rows of every key before an aggregating join's shuffle
+
+    JoinConfig()
+        : async_shuffle(false), engine(JOIN_ENGINE_AUTO), dense_max_factor(4),
+          radix_min_rows(1 << 20), radix_partition_rows(4096), threads(1),
+          skew_handling(false), skew_threshold(0.5), skew_sample_rows(4096),
+          broadcast_max_bytes(4 << 20), bloom_filter(false), bloom_bits_per_key(8),
+          simd(SIMD_SCALAR), prefetch_group(16), compress_shuffle(false),
+          batch_rows(1 << 20), memory_budget(int64_t(1) << 30), spill_partitions(64), spill_dir("/tmp"),
+          huge_pages(true), trace_file(""), hierarchical_shuffle(false), node_ranks(0),
+          partitioner(PARTITION_MODULO), partitions(0), pre_aggregate(false) {}
+};
+
+JoinConfig join_config;
+
+// largest JOIN_PREFETCH_GROUP
+static const int PREFETCH_MAX_GROUP = 64;
+
+/**
+ * @brief Read an integer option from the environment.
+ *
+ * @param name Name of the environment variable
+ * @param default_value Value to use if the variable is not set
+ * @return int64_t Value of the option
+ */
+static int64_t env_int64(const char *name, int64_t default_value)
+{
+    const char *value = getenv(name);
+    if (value == NULL || *value == '\0')
+        return default_value;
+    return strtoll(value, NULL, 10);
+}
+
+/**
+ * @brief Read a floating point option from the environment.
+ *
+ * @param name Name of the environment variable
+ * @param default_value Value to use if the variable is not set
+ * @return double Value of the option
+ */
+static double env_double(const char *name, double default_value)
+{
+    const char *value = getenv(name);
+    if (value == NULL || *value == '\0')
+        return default_value;
+    return strtod(value, NULL);
+}
+
+/**
+ * @brief Read a string option from the environment.
+ *
+ * @param name Name of the environment variable
+ * @param default_value Value to use if the variable is not set
+ * @return std::string Value of the option
+ */
+static std::string env_string(const char *name, const std::string &default_value)
+{
+    const char *value = getenv(name);
+    if (value == NULL || *value == '\0')
+        return default_value;
+    return value;
+}
+
+/**
+ * @brief Widest vector instruction set supported by the CPU at runtime.
+ */
+static SimdLevel cpu_simd_level()
+{
+#ifdef JOIN_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+#endif
+    return SIMD_SCALAR;
+}
+
+/**
+ * @brief Override the defaults in `join_config` from environment variables.
+ */
+void load_join_config()
+{
+    join_config.async_shuffle = env_int64("JOIN_ASYNC_SHUFFLE", join_config.async_shuffle) != 0;
+
+    std::string engine = env_string("JOIN_ENGINE", "auto");
+    if (engine == "auto")
+        join_config.engine = JOIN_ENGINE_AUTO;
+    else if (engine == "hash")
+        join_config.engine = JOIN_ENGINE_HASH;
+    else if (engine == "radix")
+        join_config.engine = JOIN_ENGINE_RADIX;
+    else if (engine == "sort_merge")
+        join_config.engine = JOIN_ENGINE_SORT_MERGE;
+    else if (engine == "dense")
+        join_config.engine = JOIN_ENGINE_DENSE;
+    else if (rank == 0)
+        std::cerr << "Unknown JOIN_ENGINE '" << engine << "', using auto" << std::endl;
+    join_config.dense_max_factor = env_double("JOIN_DENSE_FACTOR", join_config.dense_max_factor);
+    join_config.radix_min_rows = env_int64("JOIN_RADIX_MIN_ROWS", join_config.radix_min_rows);
+    join_config.radix_partition_rows = std::max<int64_t>(1, env_int64("JOIN_RADIX_PARTITION_ROWS", join_config.radix_partition_rows));
+    join_config.threads = env_int64("JOIN_THREADS", join_config.threads);
+    if (join_config.threads <= 0)
+        join_config.threads = std::max(1U, std::thread::hardware_concurrency());
+    join_config.skew_handling = env_int64("JOIN_SKEW", join_config.skew_handling) != 0;
+    join_config.skew_threshold = env_double("JOIN_SKEW_THRESHOLD", join_config.skew_threshold);
+    join_config.skew_sample_rows = std::max<int64_t>(0, env_int64("JOIN_SKEW_SAMPLE_ROWS", join_config.skew_sample_rows));
+    join_config.broadcast_max_bytes = env_int64("JOIN_BROADCAST_MAX_BYTES", join_config.broadcast_max_bytes);
+    join_config.bloom_filter = env_int64("JOIN_BLOOM", join_config.bloom_filter) != 0;
+    join_config.bloom_bits_per_key = std::max<int64_t>(1, env_int64("JOIN_BLOOM_BITS_PER_KEY", join_config.bloom_bits_per_key));
+
+    join_config.compress_shuffle = env_int64("JOIN_COMPRESS", join_config.compress_shuffle) != 0;
+    join_config.batch_rows = std::max<int64_t>(1, env_int64("JOIN_BATCH_ROWS", join_config.batch_rows));
+    join_config.memory_budget = env_int64("JOIN_MEMORY_BUDGET", join_config.memory_budget);
+    join_config.spill_partitions = std::max<int64_t>(1, env_int64("JOIN_SPILL_PARTITIONS", join_config.spill_partitions));
+    join_config.spill_dir = env_string("JOIN_SPILL_DIR", join_config.spill_dir);
+    join_config.huge_pages = env_int64("JOIN_HUGE_PAGES", join_config.huge_pages) != 0;
+    join_config.trace_file = env_string("JOIN_TRACE", join_config.trace_file);
+    join_config.hierarchical_shuffle = env_int64("JOIN_HIERARCHICAL", join_config.hierarchical_shuffle) != 0;
+    join_config.node_ranks = std::max<int64_t>(0, env_int64("JOIN_NODE_RANKS", join_config.node_ranks));
+    std::string partitioner = env_string("JOIN_PARTITIONER", "modulo");
+    if (partitioner == "multiplicative")
+        join_config.partitioner = PARTITION_MULTIPLICATIVE;
+    else if (partitioner == "murmur")
+        join_config.partitioner = PARTITION_MURMUR;
+    else if (partitioner != "modulo" && rank == 0)
+        std::cerr << "Unknown JOIN_PARTITIONER '" << partitioner << "', using modulo" << std::endl;
+    join_config.partitions = std::max<int64_t>(0, env_int64("JOIN_PARTITIONS", join_config.partitions));
+    join_config.pre_aggregate = env_int64("JOIN_PRE_AGGREGATE", join_config.pre_aggregate) != 0;
+    join_config.prefetch_group = std::min<int64_t>(PREFETCH_MAX_GROUP,
+                                                   env_int64("JOIN_PREFETCH_GROUP", join_config.prefetch_group));
+
+    SimdLevel cpu_simd = cpu_simd_level();
+    std::string simd = env_string("JOIN_SIMD", "auto");
+    join_config.simd = cpu_simd;
+    if (simd == "avx2")
+        join_config.simd = std::min(cpu_simd, SIMD_AVX2);
+    else if (simd == "scalar")
+        join_config.simd = SIMD_SCALAR;
+    else if (simd != "auto" && simd != "avx512" && rank == 0)
+        std::cerr << "Unknown JOIN_SIMD '" << simd << "', using auto" << std::endl;
+}
+
+// PHASE TIMING
+
+/**
+ * @brief Phases of the distributed join whose wall time is accumulated in
+ * `join_phase_seconds` (read by the benchmark, see bench.cpp).
+ * The phases do not overlap, and time outside of them (broadcast, Bloom
+ * filter, skew handling) is not attributed to any phase.
+ */
+enum JoinPhase {
+    PHASE_COUNTS,      // MPI_Alltoall of the partition sizes
+    PHASE_PACK,        // partitioning, scatter/pack of the send buffers, unpack
+    PHASE_ALLTOALLV,   // moving the partitions
+    PHASE_BUILD,       // hash table build (radix/sort-merge: partitioning or sorting)
+    PHASE_PROBE,       // lookups and match counting
+    PHASE_MATERIALIZE, // writing the output columns
+    N_JOIN_PHASES,
+};
+
+static const char *const JOIN_PHASE_NAMES[N_JOIN_PHASES] = {
+    "counts", "pack", "alltoallv", "build", "probe", "materialize",
+};
+
+double join_phase_seconds[N_JOIN_PHASES];
+
+/**
+ * @brief Set all accumulated phase times back to 0.
+ */
+void reset_join_phases()
+{
+    std::fill(join_phase_seconds, join_phase_seconds + N_JOIN_PHASES, 0.0);
+}
+
+// INSTRUMENTATION
+
+// Counters and trace spans are only collected when built with -DJOIN_STATS,
+// JOIN_STAT(statement) compiles to nothing otherwise.
+#ifdef JOIN_STATS
+#define JOIN_STAT(...) do { __VA_ARGS__; } while (0)
+#else
+#define JOIN_STAT(...) do { } while (0)
+#endif
+
+/**
+ * @brief Counters of the joins on this rank since the last reset_join_stats()
+ * (JOIN_STATS builds). Shuffle counters cover every shuffled table.
+ */
+struct JoinStats {
+    std::vector<int64_t> rows_sent; // shuffled rows per destination rank, self partition included
+    std::vector<int64_t> rows_recv; // shuffled rows per source rank, self partition included
+    int64_t bytes_sent;             // bytes sent to other ranks
+    int64_t bytes_recv;             // bytes received from other ranks
+    int64_t probe_rows;             // left rows of the local joins
+    int64_t output_rows;            // rows written by the local joins
+    int64_t tables;                 // hash tables built
+    int64_t table_rows;             // build rows inserted in them
+    int64_t table_slots;            // their slots
+    int64_t table_keys;             // their distinct keys (occupied slots)
+    int64_t probe_length_sum;       // slots read by a hit lookup, summed over the distinct keys
+    int64_t probe_length_max;       // longest hit lookup
+};
+
+JoinStats join_stats;
+
+/**
+ * @brief A phase of one rank, from begin to end (MPI_Wtime seconds).
+ */
+struct TraceSpan {
+    int phase;
+    double begin;
+    double end;
+};
+
+// Spans kept for write_join_trace, later ones are dropped
+static const size_t TRACE_MAX_SPANS = 1 << 20;
+
+std::vector<TraceSpan> join_trace;
+
+/**
+ * @brief Set all counters of `join_stats` back to 0.
+ */
+void reset_join_stats()
+{
+    join_stats = JoinStats();
+    join_stats.rows_sent.assign(n_pes, 0);
+    join_stats.rows_recv.assign(n_pes, 0);
+}
+
+#ifdef JOIN_STATS
+/**
+ * @brief Count the rows of one shuffle, from the per-rank counts of its layout.
+ *
+ * @param send_counts Rows sent to every rank (0 for this rank)
+ * @param recv_counts Rows received from every rank (0 for this rank)
+ * @param n_self Rows of the self partition
+ */
+static void record_shuffle_rows(const std::vector<int64_t> &send_counts, const std::vector<int64_t> &recv_counts,
+                                int64_t n_self)
+{
+    if (join_stats.rows_sent.size() != (size_t)n_pes)
+        reset_join_stats();
+    for (int p = 0; p < n_pes; p++) {
+        join_stats.rows_sent[p] += send_counts[p];
+        join_stats.rows_recv[p] += recv_counts[p];
+    }
+    join_stats.rows_sent[rank] += n_self;
+    join_stats.rows_recv[rank] += n_self;
+}
+#endif
+
+/**
+ * @brief Record a span of `phase` for the trace, if JOIN_TRACE is set.
+ */
+static inline void record_span(int phase, double begin, double end)
+{
+    if (!join_config.trace_file.empty() && join_trace.size() < TRACE_MAX_SPANS) {
+        TraceSpan span = {phase, begin, end};
+        join_trace.push_back(span);
+    }
+}
+
+/**
+ * @brief Print the counters of all ranks, gathered on rank 0: the rows sent
+ * between every pair of ranks (up to STATS_MAX_MATRIX_RANKS ranks), the
+ * bytes shuffled, the load imbalance (max/avg over the ranks), the hash
+ * table load factor and probe lengths, and the output fan-out.
+ * Must be called on every rank; does nothing unless built with JOIN_STATS.
+ *
+ * @param out Stream rank 0 prints to
+ */
+void print_join_stats(FILE *out)
+{
+#ifdef JOIN_STATS
+    static const int STATS_MAX_MATRIX_RANKS = 32;
+    static const int N_SCALARS = 11;
+    if (join_stats.rows_sent.size() != (size_t)n_pes)
+        reset_join_stats();
+    int64_t rows_recv = 0;
+    for (int p = 0; p < n_pes; p++)
+        rows_recv += join_stats.rows_recv[p];
+    int64_t scalars[N_SCALARS] = {
+        rows_recv, join_stats.bytes_sent, join_stats.bytes_recv, join_stats.probe_rows, join_stats.output_rows,
+        join_stats.tables, join_stats.table_rows, join_stats.table_slots, join_stats.table_keys,
+        join_stats.probe_length_sum, join_stats.probe_length_max,
+    };
+    std::vector<int64_t> all(N_SCALARS * n_pes);
+    allgather_int64(scalars, N_SCALARS, all.data());
+    std::vector<int64_t> matrix(int64_t(n_pes) * n_pes);
+    allgather_int64(join_stats.rows_sent.data(), n_pes, matrix.data());
+    if (rank != 0)
+        return;
+
+    // Sum and max over the ranks of every scalar
+    int64_t sum[N_SCALARS] = {0}, max[N_SCALARS] = {0};
+    for (int p = 0; p < n_pes; p++) {
+        for (int c = 0; c < N_SCALARS; c++) {
+            sum[c] += all[p * N_SCALARS + c];
+            max[c] = std::max(max[c], all[p * N_SCALARS + c]);
+        }
+    }
+    double avg_recv = double(sum[0]) / n_pes;
+    double avg_output = double(sum[4]) / n_pes;
+    fprintf(out, "Join stats, %d ranks\n", n_pes);
+    if (n_pes <= STATS_MAX_MATRIX_RANKS) {
+        fprintf(out, "  rows sent (row: source rank, column: destination rank)\n");
+        for (int p = 0; p < n_pes; p++) {
+            fprintf(out, "  %4d:", p);
+            for (int q = 0; q < n_pes; q++)
+                fprintf(out, " %lld", (long long)matrix[int64_t(p) * n_pes + q]);
+            fprintf(out, "\n");
+        }
+    }
+    fprintf(out, "  shuffled rows received per rank: avg %.1f, max %lld, imbalance %.3f\n", avg_recv,
+            (long long)max[0], avg_recv > 0 ? max[0] / avg_recv : 0.0);
+    fprintf(out, "  bytes sent: %lld (max per rank %lld), received: %lld (max per rank %lld)\n",
+            (long long)sum[1], (long long)max[1], (long long)sum[2], (long long)max[2]);
+    fprintf(out, "  output rows per rank: avg %.1f, max %lld, imbalance %.3f\n", avg_output,
+            (long long)max[4], avg_output > 0 ? max[4] / avg_output : 0.0);
+    fprintf(out, "  fan-out: %lld probe rows, %lld output rows, %.3f output rows per probe row\n",
+            (long long)sum[3], (long long)sum[4], sum[3] > 0 ? double(sum[4]) / sum[3] : 0.0);
+    fprintf(out, "  hash tables: %lld, %lld rows, load factor %.3f, slots read per hit avg %.3f, max %lld\n",
+            (long long)sum[5], (long long)sum[6], sum[7] > 0 ? double(sum[8]) / sum[7] : 0.0,
+            sum[8] > 0 ? double(sum[9]) / sum[8] : 0.0, (long long)max[10]);
+#else
+    (void)out;
+#endif
+}
+
+/**
+ * @brief Write the recorded phase spans of all ranks to `join_config.trace_file`
+ * in the Chrome trace event format (chrome://tracing, Perfetto), one process
+ * per rank, and clear them. The clocks of the ranks are aligned on a barrier.
+ * Must be called on every rank; does nothing unless built with JOIN_STATS
+ * and JOIN_TRACE is set.
+ */
+void write_join_trace()
+{
+#ifdef JOIN_STATS
+    if (join_config.trace_file.empty())
+        return;
+    MPI_Barrier(MPI_COMM_WORLD);
+    double now = MPI_Wtime();
+    std::vector<double> send(3 * join_trace.size());
+    for (size_t i = 0; i < join_trace.size(); i++) {
+        send[3 * i] = join_trace[i].phase;
+        send[3 * i + 1] = join_trace[i].begin - now;
+        send[3 * i + 2] = join_trace[i].end - now;
+    }
+    std::vector<TraceSpan>().swap(join_trace);
+    std::vector<int64_t> recv_counts, recv_disp;
+    int64_t n_recv = allgather_layout(send.size(), recv_counts, recv_disp);
+    std::vector<double> recv(rank == 0 ? n_recv : 0);
+    gatherv_double(send.data(), int64_t(send.size()), recv.data(), recv_counts, recv_disp);
+    if (rank != 0)
+        return;
+
+    FILE *out = fopen(join_config.trace_file.c_str(), "w");
+    if (out == NULL) {
+        perror(join_config.trace_file.c_str());
+        return;
+    }
+    double origin = 0;
+    for (size_t i = 0; i < recv.size(); i += 3)
+        origin = std::min(origin, recv[i + 1]);
+    fprintf(out, "{\"traceEvents\": [\n");
+    bool first = true;
+    for (int p = 0; p < n_pes; p++) {
+        fprintf(out, "%s{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"rank %d\"}}",
+                first ? "" : ",\n", p, p);
+        first = false;
+        for (int64_t i = recv_disp[p]; i < recv_disp[p] + recv_counts[p]; i += 3)
+            fprintf(out, ",\n{\"name\": \"%s\", \"cat\": \"join\", \"ph\": \"X\", \"pid\": %d, \"tid\": 0, "
+                         "\"ts\": %.3f, \"dur\": %.3f}",
+                    JOIN_PHASE_NAMES[int(recv[i])], p, (recv[i + 1] - origin) * 1e6, (recv[i + 2] - recv[i + 1]) * 1e6);
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+#endif
+}
+
+/**
+ * @brief Adds the time from its construction (or the last next()) to its
+ * destruction (or stop()) to a phase of `join_phase_seconds`. Timers must
+ * not be nested, so a timer is stopped around calls that time themselves.
+ * Only the thread that calls MPI may use it.
+ */
+class PhaseTimer
+{
+public:
+    explicit PhaseTimer(JoinPhase phase) : phase(phase), start(MPI_Wtime()) {}
+
+    ~PhaseTimer() { stop(); }
+
+    /**
+     * @brief End the current phase (if any) and start timing `next_phase`.
+     */
+    void next(JoinPhase next_phase)
+    {
+        double now = MPI_Wtime();
+        add(now);
+        phase = next_phase;
+        start = now;
+    }
+
+    /**
+     * @brief End the current phase without starting another one.
+     */
+    void stop()
+    {
+        add(MPI_Wtime());
+        phase = N_JOIN_PHASES;
+    }
+
+private:
+    void add(double now)
+    {
+        if (phase == N_JOIN_PHASES)
+            return;
+        join_phase_seconds[phase] += now - start;
+        JOIN_STAT(record_span(phase, start, now));
+    }
+
+    JoinPhase phase;
+    double start;
+};
+
+// THREADING
+
+// rows per unit of work handed out to the local join threads
+static const int64_t MORSEL_ROWS = 16384;
+
+/**
+ * @brief Run `fn(thread_id)` on `n_threads` threads and wait for all of them.
+ * The calling thread runs thread 0. Only the calling thread may use MPI
+ * (the library is initialized with MPI_THREAD_FUNNELED).
+ */
+template <typename F>
+static void run_threads(int n_threads, F fn)
+{
+    std::vector<std::thread> threads;
+    for (int t = 1; t < n_threads; t++)
+        threads.push_back(std::thread(fn, t));
+    fn(0);
+    for (size_t t = 0; t < threads.size(); t++)
+        threads[t].join();
+}
+
+/**
+ * @brief Run `fn(morsel)` for every morsel in [0, n_morsels) on up to
+ * `n_threads` threads. Morsels are handed out dynamically, so threads that
+ * get cheap morsels pick up more of them.
+ */
+template <typename F>
+static void for_each_morsel(int n_threads, int64_t n_morsels, F fn)
+{
+    n_threads = std::max<int64_t>(1, std::min<int64_t>(n_threads, n_morsels));
+    if (n_threads == 1) {
+        for (int64_t m = 0; m < n_morsels; m++)
+            fn(m);
+        return;
+    }
+    std::atomic<int64_t> next(0);
+    run_threads(n_threads, [&](int) {
+        for (int64_t m = next++; m < n_morsels; m = next++)
+            fn(m);
+    });
+}
+
+// LOCAL JOIN ENGINE
+
+/**
+ * @brief Hash function for int32 join keys (Fibonacci multiplicative hashing).
+ * The high bits of the product are well mixed, so the table index is taken
+ * from the top `bits` bits.
+ *
+ * @param key Join key
+ * @param bits log2 of the table capacity
+ * @return uint64_t Slot index in [0, 2^bits)
+ */
+static inline uint64_t hash_key(int key, int bits)
+{
+    return (static_cast<uint64_t>(static_cast<uint32_t>(key)) * 0x9E3779B97F4A7C15ULL) >> (64 - bits);
+}
+
+// largest table (log2 of the slots, 1 MiB) probed with the vectorized lookups: bigger tables miss
+// the cache, and gathers that wait on DRAM are slower than independent scalar lookups
+static const int SIMD_MAX_TABLE_BITS = 16;
+
+#ifdef JOIN_X86_SIMD
+/**
+ * @brief Vectorized lookup of keys [0, n - n % 8) in a JoinHashTable, 8 keys
+ * at a time: the keys are hashed like hash_key, and the slots of all lanes
+ * are gathered and compared at once until every lane hits its key or an
+ * empty slot.
+ *
+ * @param slot_ints Slots of the table, seen as 4 ints each (key, count, start)
+ * @param bits log2 of the table capacity (at most 29, for 32-bit gather indices)
+ * @param region_mask Region mask of the table (see JoinHashTable::next_slot)
+ * @param keys Probe keys
+ * @param n Number of probe keys
+ * @param[out] slot_idx Slot of every key, or -1 if it is not in the table
+ * @return int64_t Number of keys looked up
+ */
+__attribute__((target("avx2")))
+static int64_t find_slots_avx2(const int *slot_ints, int bits, uint32_t region_mask, const int *keys,
+                               int64_t n, int *slot_idx)
+{
+    // hash_key keeps the top 32 bits of key * C: hi32(key * C_lo) + key * C_hi
+    const __m256i c_lo = _mm256_set1_epi32(0x7F4A7C15);
+    const __m256i c_hi = _mm256_set1_epi32(0x9E3779B9);
+    const __m128i shift = _mm_cvtsi32_si128(32 - bits);
+    const __m256i region = _mm256_set1_epi32(region_mask);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i all = _mm256_set1_epi32(-1);
+
+    int64_t n_vec = n - n % 8;
+    for (int64_t i = 0; i < n_vec; i += 8) {
+        __m256i k = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i));
+        __m256i even = _mm256_srli_epi64(_mm256_mul_epu32(k, c_lo), 32);
+        __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(k, 32), c_lo);
+        __m256i h = _mm256_add_epi32(_mm256_blend_epi32(even, odd, 0xAA), _mm256_mullo_epi32(k, c_hi));
+        __m256i s = _mm256_srl_epi32(h, shift);
+
+        __m256i result = all;
+        __m256i active = all;
+        while (true) {
+            __m256i idx = _mm256_slli_epi32(s, 2);
+            __m256i slot_key = _mm256_mask_i32gather_epi32(zero, slot_ints, idx, active, 4);
+            __m256i slot_count = _mm256_mask_i32gather_epi32(zero, slot_ints + 1, idx, active, 4);
+            __m256i empty = _mm256_cmpeq_epi32(slot_count, zero);
+            __m256i hit = _mm256_and_si256(active, _mm256_andnot_si256(empty, _mm256_cmpeq_epi32(slot_key, k)));
+            result = _mm256_blendv_epi8(result, s, hit);
+            active = _mm256_andnot_si256(_mm256_or_si256(empty, hit), active);
+            if (_mm256_testz_si256(active, active))
+                break;
+            s = _mm256_or_si256(_mm256_andnot_si256(region, s),
+                                _mm256_and_si256(_mm256_add_epi32(s, one), region));
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(slot_idx + i), result);
+    }
+    return n_vec;
+}
+
+/**
+ * @brief Same as find_slots_avx2, except 16 keys at a time with AVX-512
+ * (keys [0, n - n % 16)), lanes are tracked with mask registers.
+ */
+__attribute__((target("avx512f")))
+static int64_t find_slots_avx512(const int *slot_ints, int bits, uint32_t region_mask, const int *keys,
+                                 int64_t n, int *slot_idx)
+{
+    const __m512i c_lo = _mm512_set1_epi32(0x7F4A7C15);
+    const __m512i c_hi = _mm512_set1_epi32(0x9E3779B9);
+    const __m128i shift = _mm_cvtsi32_si128(32 - bits);
+    const __m512i region = _mm512_set1_epi32(region_mask);
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i one = _mm512_set1_epi32(1);
+
+    int64_t n_vec = n - n % 16;
+    for (int64_t i = 0; i < n_vec; i += 16) {
+        __m512i k = _mm512_loadu_si512(keys + i);
+        __m512i even = _mm512_srli_epi64(_mm512_mul_epu32(k, c_lo), 32);
+        __m512i odd = _mm512_mul_epu32(_mm512_srli_epi64(k, 32), c_lo);
+        __m512i h = _mm512_add_epi32(_mm512_mask_blend_epi32(0xAAAA, even, odd), _mm512_mullo_epi32(k, c_hi));
+        __m512i s = _mm512_srl_epi32(h, shift);
+
+        __m512i result = _mm512_set1_epi32(-1);
+        __mmask16 active = 0xFFFF;
+        while (true) {
+            __m512i idx = _mm512_slli_epi32(s, 2);
+            __m512i slot_key = _mm512_mask_i32gather_epi32(zero, active, idx, slot_ints, 4);
+            __m512i slot_count = _mm512_mask_i32gather_epi32(zero, active, idx, slot_ints + 1, 4);
+            __mmask16 empty = _mm512_mask_cmpeq_epi32_mask(active, slot_count, zero);
+            __mmask16 hit = _mm512_mask_cmpeq_epi32_mask(active & ~empty, slot_key, k);
+            result = _mm512_mask_mov_epi32(result, hit, s);
+            active &= ~(empty | hit);
+            if (active == 0)
+                break;
+            s = _mm512_or_si512(_mm512_andnot_si512(region, s),
+                                _mm512_and_si512(_mm512_add_epi32(s, one), region));
+        }
+        _mm512_storeu_si512(slot_idx + i, result);
+    }
+    return n_vec;
+}
+#endif
+
+/**
+ * @brief Open-addressing (linear probing) hash table over the build side keys.
+ * Every distinct key owns one slot which points to a contiguous run in `rows`
+ * holding the indices of all build rows with that key, so duplicate keys
+ * on the build side produce all of their matches.
+ * For a parallel build the slots are split into `2^part_bits` regions by the
+ * top hash bits, and probing wraps around inside a region, so every region
+ * can be filled by a different thread.
+ */
+struct JoinHashTable {
+    struct Slot {
+        int key;
+        int count;      // 0 means the slot is empty
+        int64_t start;  // offset of this key's run in `rows`
+    };
+    static_assert(sizeof(Slot) == 4 * sizeof(int), "the vectorized lookups gather slots as 4 ints");
+
+    std::vector<Slot> slots;
+    std::vector<int64_t> rows;
+    int bits;
+    uint64_t mask;
+    int part_bits;
+    uint64_t region_mask;
+
+    std::vector<uint64_t> row_slot; // slot of every inserted row, used by finalize()
+
+    /**
+     * @brief Size an empty table for `n` build rows.
+     *
+     * @param n Number of build side rows that will be inserted
+     */
+    void init(int64_t n)
+    {
+        // Keep the load factor at or below 0.5
+        bits = 1;
+        while ((int64_t(1) << bits) < 2 * n)
+            bits++;
+        mask = (uint64_t(1) << bits) - 1;
+        part_bits = 0;
+        region_mask = mask;
+        Slot empty = {0, 0, 0};
+        slots.assign(uint64_t(1) << bits, empty);
+        row_slot.resize(n);
+    }
+
+    /**
+     * @brief Insert build rows [begin, end) and count the rows of each key.
+     * Ranges may be inserted in any order, but every row must be inserted
+     * exactly once before finalize().
+     *
+     * @param keys Build side key column
+     * @param begin First row to insert
+     * @param end One past the last row to insert
+     */
+    void insert(const int *keys, int64_t begin, int64_t end)
+    {
+        for (int64_t i = begin; i < end; i++) {
+            uint64_t s = hash_key(keys[i], bits);
+            while (slots[s].count != 0 && slots[s].key != keys[i])
+                s = next_slot(s);
+            slots[s].key = keys[i];
+            slots[s].count++;
+            row_slot[i] = s;
+        }
+    }
+
+    /**
+     * @brief Next slot in the linear probing sequence (wraps inside a region).
+     */
+    inline uint64_t next_slot(uint64_t s) const
+    {
+        return (s & ~region_mask) | ((s + 1) & region_mask);
+    }
+
+    /**
+     * @brief Lay out the row indices of every key contiguously in `rows`.
+     */
+    void finalize()
+    {
+        // Exclusive prefix sum of the counts gives each key's run in `rows`
+        int64_t offset = 0;
+        for (size_t s = 0; s < slots.size(); s++) {
+            slots[s].start = offset;
+            offset += slots[s].count;
+        }
+
+        // Scatter row indices into their runs (`start` is used as a cursor)
+        int64_t n = row_slot.size();
+        rows.resize(n);
+        for (int64_t i = 0; i < n; i++)
+            rows[slots[row_slot[i]].start++] = i;
+        for (size_t s = 0; s < slots.size(); s++)
+            slots[s].start -= slots[s].count;
+        std::vector<uint64_t>().swap(row_slot);
+    }
+
+    /**
+     * @brief Build the table over `n` keys.
+     *
+     * @param keys Build side key column
+     * @param n Number of build side rows
+     */
+    void build(const int *keys, int64_t n)
+    {
+        init(n);
+        insert(keys, 0, n);
+        finalize();
+    }
+
+    /**
+     * @brief Build the table over `n` keys with `n_threads` threads.
+     * Rows are first partitioned by region, then every region is filled and
+     * laid out by one thread. Small tables, and regions that would overflow
+     * (too many distinct keys hash into one region), use the serial build.
+     *
+     * @param keys Build side key column
+     * @param n Number of build side rows
+     * @param n_threads Number of threads to use
+     */
+    void build_parallel(const int *keys, int64_t n, int n_threads)
+    {
+        // smallest region worth a thread of its own
+        static const int MIN_REGION_BITS = 12;
+
+        init(n);
+        int pbits = 0;
+        while ((1 << pbits) < n_threads)
+            pbits++;
+        if (n_threads <= 1 || bits - pbits < MIN_REGION_BITS) {
+            insert(keys, 0, n);
+            finalize();
+            return;
+        }
+        part_bits = pbits;
+        region_mask = mask >> pbits;
+        const int n_regions = 1 << pbits;
+        const int region_shift = bits - pbits;
+        const int64_t chunk = (n + n_threads - 1) / n_threads;
+
+        // Partition the row indices by region, keeping row order in each region
+        std::vector<int64_t> hist(n_threads * n_regions, 0);
+        run_threads(n_threads, [&](int t) {
+            int64_t *h = &hist[t * n_regions];
+            for (int64_t i = t * chunk; i < std::min(n, (t + 1) * chunk); i++)
+                h[hash_key(keys[i], bits) >> region_shift]++;
+        });
+        std::vector<int64_t> region_begin(n_regions + 1);
+        int64_t pos = 0;
+        for (int r = 0; r < n_regions; r++) {
+            region_begin[r] = pos;
+            for (int t = 0; t < n_threads; t++) {
+                int64_t count = hist[t * n_regions + r];
+                hist[t * n_regions + r] = pos;
+                pos += count;
+            }
+        }
+        region_begin[n_regions] = pos;
+        std::vector<int64_t> region_rows(n);
+        run_threads(n_threads, [&](int t) {
+            int64_t *cursor = &hist[t * n_regions];
+            for (int64_t i = t * chunk; i < std::min(n, (t + 1) * chunk); i++)
+                region_rows[cursor[hash_key(keys[i], bits) >> region_shift]++] = i;
+        });
+
+        // Insert every region; a region's runs start where its rows start in `rows`
+        std::atomic<bool> overflow(false);
+        rows.resize(n);
+        run_threads(n_threads, [&](int t) {
+            for (int r = t; r < n_regions && !overflow; r += n_threads) {
+                uint64_t distinct = 0;
+                for (int64_t j = region_begin[r]; j < region_begin[r + 1]; j++) {
+                    int64_t i = region_rows[j];
+                    uint64_t s = hash_key(keys[i], bits);
+                    while (slots[s].count != 0 && slots[s].key != keys[i])
+                        s = next_slot(s);
+                    if (slots[s].count == 0 && ++distinct > region_mask) {
+                        overflow = true;
+                        return;
+                    }
+                    slots[s].key = keys[i];
+                    slots[s].count++;
+                    row_slot[i] = s;
+                }
+
+                uint64_t first = uint64_t(r) << region_shift;
+                int64_t offset = region_begin[r];
+                for (uint64_t s = first; s <= first + region_mask; s++) {
+                    slots[s].start = offset;
+                    offset += slots[s].count;
+                }
+                for (int64_t j = region_begin[r]; j < region_begin[r + 1]; j++)
+                    rows[slots[row_slot[region_rows[j]]].start++] = region_rows[j];
+                for (uint64_t s = first; s <= first + region_mask; s++)
+                    slots[s].start -= slots[s].count;
+            }
+        });
+        if (overflow) {
+            build(keys, n);
+            return;
+        }
+        std::vector<uint64_t>().swap(row_slot);
+    }
+
+    /**
+     * @brief Slots a successful lookup reads, summed and maxed over the distinct keys.
+     *
+     * @param[out] sum Sum over the occupied slots of their distance to the home slot, plus one
+     * @param[out] max Largest such distance plus one
+     * @return int64_t Number of distinct keys
+     */
+    int64_t probe_lengths(int64_t &sum, int64_t &max) const
+    {
+        int64_t n_keys = 0;
+        sum = max = 0;
+        for (size_t s = 0; s < slots.size(); s++) {
+            if (slots[s].count == 0)
+                continue;
+            int64_t length = ((s - hash_key(slots[s].key, bits)) & region_mask) + 1;
+            sum += length;
+            max = std::max(max, length);
+            n_keys++;
+        }
+        return n_keys;
+    }
+
+    /**
+     * @brief Look up the slot of `key`.
+     *
+     * @param key Probe key
+     * @return const Slot* The slot for `key`, or NULL if it is not in the table
+     */
+    const Slot *find(int key) const
+    {
+        return find_from(key, hash_key(key, bits));
+    }
+
+    /**
+     * @brief Same as find(), with the home slot `s = hash_key(key, bits)` given.
+     */
+    const Slot *find_from(int key, uint64_t s) const
+    {
+        while (slots[s].count != 0) {
+            if (slots[s].key == key)
+                return &slots[s];
+            s = next_slot(s);
+        }
+        return NULL;
+    }
+
+    /**
+     * @brief Look up the slots of `n` keys, same as find() on every key.
+     * Uses the vectorized lookup selected by `join_config.simd` when the
+     * table fits in the cache (see SIMD_MAX_TABLE_BITS).
+     *
+     * @param keys Probe keys
+     * @param n Number of probe keys
+     * @param[out] out Slot of every key, or NULL if it is not in the table
+     */
+    void find_batch(const int *keys, int64_t n, const Slot **out) const
+    {
+        int64_t i = 0;
+#ifdef JOIN_X86_SIMD
+        static const int64_t BATCH = 256;
+        if (join_config.simd != SIMD_SCALAR && bits <= SIMD_MAX_TABLE_BITS) {
+            const int *slot_ints = reinterpret_cast<const int *>(slots.data());
+            int slot_idx[BATCH];
+            while (i + 16 <= n) {
+                int64_t batch = std::min(BATCH, n - i);
+                int64_t done = join_config.simd == SIMD_AVX512
+                                   ? find_slots_avx512(slot_ints, bits, region_mask, keys + i, batch, slot_idx)
+                                   : find_slots_avx2(slot_ints, bits, region_mask, keys + i, batch, slot_idx);
+                for (int64_t j = 0; j < done; j++)
+                    out[i + j] = slot_idx[j] < 0 ? NULL : &slots[slot_idx[j]];
+                i += done;
+            }
+        }
+#endif
+        // Group prefetching: the home slots of a whole group are requested
+        // before the first one is read, so their cache misses overlap
+        const int group = join_config.prefetch_group;
+        if (group > 1 && bits > SIMD_MAX_TABLE_BITS) {
+            uint64_t home[PREFETCH_MAX_GROUP];
+            for (; i + group <= n; i += group) {
+                for (int j = 0; j < group; j++) {
+                    home[j] = hash_key(keys[i + j], bits);
+                    __builtin_prefetch(&slots[home[j]]);
+                }
+                for (int j = 0; j < group; j++)
+                    out[i + j] = find_from(keys[i + j], home[j]);
+            }
+        }
+        for (; i < n; i++)
+            out[i] = find(keys[i]);
+    }
+};
+
+#ifdef JOIN_STATS
+/**
+ * @brief Count a built hash table in `join_stats` (JOIN_STATS builds).
+ */
+static void record_table(const JoinHashTable &table)
+{
+    int64_t sum, max;
+    join_stats.table_keys += table.probe_lengths(sum, max);
+    join_stats.probe_length_sum += sum;
+    join_stats.probe_length_max = std::max(join_stats.probe_length_max, max);
+    join_stats.table_slots += table.slots.size();
+    join_stats.table_rows += table.rows.size();
+    join_stats.tables++;
+}
+#endif
+
+/**
+ * @brief Kind of join, i.e. which rows are output.
+ */
+enum JoinType {
+    JOIN_INNER,      // every matching (left, right) row pair
+    JOIN_LEFT_OUTER, // inner, plus every left row without a match, with null payloads
+    JOIN_SEMI,       // the key of every left row with a match (EXISTS)
+    JOIN_ANTI,       // the key of every left row without a match (NOT EXISTS)
+    JOIN_COUNT,      // nothing, only the number of matching row pairs
+};
+
+// payloads of the left rows without a match in a left outer join
+static const int JOIN_NULL_INT = INT_MIN;
+static const double JOIN_NULL_DOUBLE = std::numeric_limits<double>::quiet_NaN();
+
+/**
+ * @brief Whether a join type outputs right table payloads (otherwise only
+ * the right keys need to be shuffled).
+ */
+static inline bool join_has_payload(JoinType type)
+{
+    return type == JOIN_INNER || type == JOIN_LEFT_OUTER;
+}
+
+/**
+ * @brief Whether a join type outputs left rows without a match, which is
+ * only known where all right rows with the same key are.
+ */
+static inline bool join_needs_unmatched(JoinType type)
+{
+    return type == JOIN_LEFT_OUTER || type == JOIN_ANTI;
+}
+
+/**
+ * @brief Probe `table` with `n` keys in two passes: matches are counted
+ * first, so the output can be sized exactly once before it is written.
+ * With more than one thread, both passes run over morsels of the probe
+ * keys, and every morsel writes its matches at the offset given by the
+ * prefix sum of the morsel counts.
+ *
+ * @param table Hash table built over the right table keys
+ * @param keys Probe keys (left table)
+ * @param n Number of probe keys
+ * @param n_threads Number of threads to use
+ * @param resize Called once as resize(n_matches) between the two passes
+ * @param emit Called as emit(out, i, index) for every match: probe row i
+ *  matches build row `index`, and this is match number `out`
+ * @param outer Whether probe rows without a match are emitted too, once
+ *  each with `index` -1 (left outer join)
+ */
+template <typename Resize, typename Emit>
+static void probe_two_pass(const JoinHashTable &table, const int *keys, int64_t n, int n_threads,
+                           Resize resize, Emit emit, bool outer = false)
+{
+    // First pass: look up every probe row and count the output size
+    PhaseTimer timer(PHASE_PROBE);
+    int64_t n_morsels = (n + MORSEL_ROWS - 1) / MORSEL_ROWS;
+    std::vector<const JoinHashTable::Slot *> probe_slots(n);
+    std::vector<int64_t> morsel_out(n_morsels + 1, 0);
+    for_each_morsel(n_threads, n_morsels, [&](int64_t m) {
+        int64_t begin = m * MORSEL_ROWS;
+        int64_t end = std::min(n, (m + 1) * MORSEL_ROWS);
+        table.find_batch(keys + begin, end - begin, &probe_slots[begin]);
+        int64_t count = 0;
+        for (int64_t i = begin; i < end; i++) {
+            if (probe_slots[i] != NULL)
+                count += probe_slots[i]->count;
+            else if (outer)
+                count++;
+        }
+        morsel_out[m + 1] = count;
+    });
+    for (int64_t m = 0; m < n_morsels; m++)
+        morsel_out[m + 1] += morsel_out[m];
+
+    // Second pass: write matches directly into exactly sized outputs.
+    // For tables out of the cache, the slots are prefetched two groups
+    // ahead and their runs in `rows` one group ahead.
+    timer.next(PHASE_MATERIALIZE);
+    resize(morsel_out[n_morsels]);
+    const int64_t distance = table.bits > SIMD_MAX_TABLE_BITS ? join_config.prefetch_group : 0;
+    for_each_morsel(n_threads, n_morsels, [&](int64_t m) {
+        int64_t out = morsel_out[m];
+        int64_t end = std::min(n, (m + 1) * MORSEL_ROWS);
+        for (int64_t i = m * MORSEL_ROWS; i < end; i++) {
+            if (distance > 1) {
+                if (i + 2 * distance < end && probe_slots[i + 2 * distance] != NULL)
+                    __builtin_prefetch(probe_slots[i + 2 * distance]);
+                if (i + distance < end && probe_slots[i + distance] != NULL)
+                    __builtin_prefetch(&table.rows[probe_slots[i + distance]->start]);
+            }
+            const JoinHashTable::Slot *slot = probe_slots[i];
+            if (slot == NULL) {
+                if (outer)
+                    emit(out++, i, -1);
+                continue;
+            }
+            for (int64_t j = slot->start; j < slot->start + slot->count; j++, out++)
+                emit(out, i, table.rows[j]);
+        }
+    });
+}
+
+/**
+ * @brief Probe `table` with `n` keys and append every match to the output
+ * columns (see probe_two_pass).
+ *
+ * @param table Hash table built over the right table keys
+ * @param keys Probe keys (left table)
+ * @param n Number of probe keys
+ * @param data0 First data column of the right table
+ * @param data1 Second data column of the right table
+ * @param[out] keys_result Output key column
+ * @param[out] data0_result Output first data column
+ * @param[out] data1_result Output second data column
+ * @param n_threads Number of threads to use
+ * @param outer Whether probe keys without a match are appended too, with
+ *  JOIN_NULL_DOUBLE and JOIN_NULL_INT payloads (left outer join)
+ */
+static void probe_append(const JoinHashTable &table, const int *keys, int64_t n,
+                         const double *data0, const int *data1, std::vector<int> &keys_result,
+                         std::vector<double> &data0_result, std::vector<int> &data1_result,
+                         int n_threads = 1, bool outer = false)
+{
+    int64_t base = keys_result.size();
+    probe_two_pass(table, keys, n, n_threads,
+        [&](int64_t n_out) {
+            keys_result.resize(base + n_out);
+            data0_result.resize(base + n_out);
+            data1_result.resize(base + n_out);
+        },
+        [&](int64_t out, int64_t i, int64_t index) {
+            keys_result[base + out] = keys[i];
+            data0_result[base + out] = index < 0 ? JOIN_NULL_DOUBLE : data0[index];
+            data1_result[base + out] = index < 0 ? JOIN_NULL_INT : data1[index];
+        }, outer);
+}
+
+/**
+ * @brief Append the probe keys that have a match in `table` (semi join), or
+ * those that have none (anti join), to `keys_result`. Two passes over
+ * morsels, as in probe_two_pass, but nothing of the right table is read.
+ *
+ * @param table Hash table built over the right table keys
+ * @param keys Probe keys (left table)
+ * @param n Number of probe keys
+ * @param matched Whether to keep the keys with a match (semi) or without (anti)
+ * @param[out] keys_result Output key column
+ * @param n_threads Number of threads to use
+ */
+static void probe_filter(const JoinHashTable &table, const int *keys, int64_t n, bool matched,
+                         std::vector<int> &keys_result, int n_threads = 1)
+{
+    PhaseTimer timer(PHASE_PROBE);
+    int64_t n_morsels = (n + MORSEL_ROWS - 1) / MORSEL_ROWS;
+    std::vector<const JoinHashTable::Slot *> probe_slots(n);
+    std::vector<int64_t> morsel_out(n_morsels + 1, 0);
+    for_each_morsel(n_threads, n_morsels, [&](int64_t m) {
+        int64_t begin = m * MORSEL_ROWS;
+        int64_t end = std::min(n, (m + 1) * MORSEL_ROWS);
+        table.find_batch(keys + begin, end - begin, &probe_slots[begin]);
+        int64_t count = 0;
+        for (int64_t i = begin; i < end; i++)
+            count += (probe_slots[i] != NULL) == matched;
+        morsel_out[m + 1] = count;
+    });
+    for (int64_t m = 0; m < n_morsels; m++)
+        morsel_out[m + 1] += morsel_out[m];
+
+    timer.next(PHASE_MATERIALIZE);
+    int64_t base = keys_result.size();
+    keys_result.resize(base + morsel_out[n_morsels]);
+    for_each_morsel(n_threads, n_morsels, [&](int64_t m) {
+        int *out = keys_result.data() + base + morsel_out[m];
+        int64_t end = std::min(n, (m + 1) * MORSEL_ROWS);
+        for (int64_t i = m * MORSEL_ROWS; i < end; i++) {
+            if ((probe_slots[i] != NULL) == matched)
+                *out++ = keys[i];
+        }
+    });
+}
+
+/**
+ * @brief Number of (probe row, build row) matches of the probe keys in
+ * `table`, without writing any output.
+ *
+ * @param table Hash table built over the right table keys
+ * @param keys Probe keys (left table)
+ * @param n Number of probe keys
+ * @param n_threads Number of threads to use
+ * @return int64_t Number of matching row pairs
+ */
+static int64_t probe_count(const JoinHashTable &table, const int *keys, int64_t n, int n_threads = 1)
+{
+    // slots looked up at once, on the stack
+    static const int64_t BATCH = 256;
+    PhaseTimer timer(PHASE_PROBE);
+    int64_t n_morsels = (n + MORSEL_ROWS - 1) / MORSEL_ROWS;
+    std::vector<int64_t> morsel_count(n_morsels, 0);
+    for_each_morsel(n_threads, n_morsels, [&](int64_t m) {
+        const JoinHashTable::Slot *slots[BATCH];
+        int64_t end = std::min(n, (m + 1) * MORSEL_ROWS);
+        int64_t count = 0;
+        for (int64_t begin = m * MORSEL_ROWS; begin < end; begin += BATCH) {
+            int64_t batch = std::min(BATCH, end - begin);
+            table.find_batch(keys + begin, batch, slots);
+            for (int64_t i = 0; i < batch; i++)
+                count += slots[i] != NULL ? slots[i]->count : 0;
+        }
+        morsel_count[m] = count;
+    });
+    int64_t total = 0;
+    for (int64_t m = 0; m < n_morsels; m++)
+        total += morsel_count[m];
+    return total;
+}
+
+/**
+ * @brief Hash join of the left keys with the right table using a single
+ * JoinHashTable, built into `table` (whose capacity is reused).
+ * Matches are appended to the output columns.
+ */
+static void hash_join(const int *keys1, int64_t n1, const int *keys2, const double *data0,
+                      const int *data1, int64_t n2, std::vector<int> &keys_result,
+                      std::vector<double> &data0_result, std::vector<int> &data1_result,
+                      JoinHashTable &table)
+{
+    {
+        PhaseTimer timer(PHASE_BUILD);
+        table.build_parallel(keys2, n2, join_config.threads);
+    }
+    JOIN_STAT(record_table(table));
+    probe_append(table, keys1, n1, data0, data1, keys_result, data0_result, data1_result, join_config.threads);
+}
+
+/**
+ * @brief Same as hash_join, for the join types other than inner (see
+ * JoinType). The right data columns are only read by the left outer join.
+ *
+ * @return int64_t Number of matching row pairs for JOIN_COUNT, which
+ *  appends nothing, otherwise the number of rows appended
+ */
+static int64_t hash_join_typed(JoinType type, const int *keys1, int64_t n1, const int *keys2, const double *data0,
+                               const int *data1, int64_t n2, std::vector<int> &keys_result,
+                               std::vector<double> &data0_result, std::vector<int> &data1_result,
+                               JoinHashTable &table)
+{
+    {
+        PhaseTimer timer(PHASE_BUILD);
+        table.build_parallel(keys2, n2, join_config.threads);
+    }
+    JOIN_STAT(record_table(table));
+    int64_t base = keys_result.size();
+    if (type == JOIN_COUNT)
+        return probe_count(table, keys1, n1, join_config.threads);
+    if (type == JOIN_SEMI || type == JOIN_ANTI)
+        probe_filter(table, keys1, n1, type == JOIN_SEMI, keys_result, join_config.threads);
+    else
+        probe_append(table, keys1, n1, data0, data1, keys_result, data0_result, data1_result,
+                     join_config.threads, type == JOIN_LEFT_OUTER);
+    return keys_result.size() - base;
+}
+
+// RADIX PARTITIONED JOIN
+
+// maximum radix bits per partitioning pass, bounds the fan-out (TLB and write-combining buffers)
+static const int RADIX_MAX_BITS_PER_PASS = 10;
+
+/**
+ * @brief Mix the bits of a key (murmur3 32-bit finalizer).
+ * Radix partitions are taken from these bits, which are independent from the
+ * bits hash_key() uses inside a partition's table, and unaffected by the
+ * partition (see key_partition) that all keys on a rank share after the shuffle.
+ */
+static inline uint32_t mix_key(int key)
+{
+    uint32_t h = static_cast<uint32_t>(key);
+    h ^= h >> 16;
+    h *= 0x85EBCA6BU;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35U;
+    h ^= h >> 16;
+    return h;
+}
+
+static inline int row_key(int key) { return key; }
+static inline int row_key(const JoinRow &row) { return row.key; }
+
+/**
+ * @brief One radix partitioning pass: scatter `n` elements into `2^bits`
+ * contiguous partitions by bits [shift, shift + bits) of mix_key().
+ * Elements are staged in a cache-line sized write-combining buffer per
+ * partition, and only full lines are written to `out`.
+ *
+ * @param in Elements to partition
+ * @param n Number of elements
+ * @param shift First radix bit of this pass
+ * @param bits Number of radix bits of this pass
+ * @param[out] out Partitioned elements (n elements)
+ * @param[out] offsets Start of every partition in `out`, plus the end (2^bits + 1 elements)
+ */
+template <typename T>
+static void radix_scatter(const T *in, int64_t n, int shift, int bits, T *out, int64_t *offsets)
+{
+    const int64_t n_parts = int64_t(1) << bits;
+    const uint32_t mask = n_parts - 1;
+    const int per_line = sizeof(T) >= 64 ? 1 : 64 / sizeof(T);
+
+    // Histogram and exclusive prefix sum
+    std::vector<int64_t> dst(n_parts + 1, 0);
+    for (int64_t i = 0; i < n; i++)
+        dst[((mix_key(row_key(in[i])) >> shift) & mask) + 1]++;
+    for (int64_t p = 0; p < n_parts; p++)
+        dst[p + 1] += dst[p];
+    std::copy(dst.begin(), dst.end(), offsets);
+
+    std::vector<T> wc(n_parts * per_line);
+    std::vector<int> fill(n_parts, 0);
+    for (int64_t i = 0; i < n; i++) {
+        uint32_t p = (mix_key(row_key(in[i])) >> shift) & mask;
+        T *line = &wc[p * per_line];
+        line[fill[p]++] = in[i];
+        if (fill[p] == per_line) {
+            memcpy(out + dst[p], line, sizeof(T) * per_line);
+            dst[p] += per_line;
+            fill[p] = 0;
+        }
+    }
+    for (int64_t p = 0; p < n_parts; p++)
+        memcpy(out + dst[p], &wc[p * per_line], sizeof(T) * fill[p]);
+}
+
+/**
+ * @brief Radix partition `in` into `2^(bits1 + bits2)` partitions, with one
+ * pass if `bits2` is 0 and two passes otherwise.
+ *
+ * @param in Elements to partition
+ * @param bits1 Radix bits of the first pass
+ * @param bits2 Radix bits of the second pass
+ * @param[out] out Partitioned elements
+ * @param[out] offsets Start of every partition in `out`, plus the end
+ */
+template <typename T>
+static void radix_partition(const std::vector<T> &in, int bits1, int bits2,
+                            std::vector<T> &out, std::vector<int64_t> &offsets)
+{
+    int64_t n = in.size();
+    out.resize(n);
+    offsets.resize((int64_t(1) << (bits1 + bits2)) + 1);
+    if (bits2 == 0) {
+        radix_scatter(in.data(), n, 0, bits1, out.data(), offsets.data());
+        return;
+    }
+
+    std::vector<T> tmp(n);
+    std::vector<int64_t> offsets1((int64_t(1) << bits1) + 1);
+    radix_scatter(in.data(), n, 0, bits1, tmp.data(), offsets1.data());
+    for (int64_t q = 0; q < (int64_t(1) << bits1); q++) {
+        int64_t *sub_offsets = &offsets[q << bits2];
+        radix_scatter(tmp.data() + offsets1[q], offsets1[q + 1] - offsets1[q], bits1, bits2,
+                      out.data() + offsets1[q], sub_offsets);
+        for (int64_t p = 0; p <= (int64_t(1) << bits2); p++)
+            sub_offsets[p] += offsets1[q];
+    }
+}
+
+/**
+ * @brief Radix partitioned hash join for right tables larger than the cache.
+ * Both sides are partitioned on the same radix bits, so each left partition
+ * only needs to be probed against the small, cache resident hash table of
+ * the matching right partition. Matches are appended to the output columns.
+ */
+static void radix_join(const int *keys1, int64_t n1, const int *keys2, const double *data0,
+                       const int *data1, int64_t n2, std::vector<int> &keys_result,
+                       std::vector<double> &data0_result, std::vector<int> &data1_result)
+{
+    int bits = 0;
+    while ((n2 >> bits) > join_config.radix_partition_rows)
+        bits++;
+    int bits1 = bits > RADIX_MAX_BITS_PER_PASS ? (bits + 1) / 2 : bits;
+    int bits2 = bits - bits1;
+    int64_t n_parts = int64_t(1) << bits;
+
+    PhaseTimer timer(PHASE_BUILD);
+    std::vector<JoinRow> right(n2);
+    for (int64_t i = 0; i < n2; i++) {
+        right[i].key = keys2[i];
+        right[i].data1 = data1[i];
+        right[i].data0 = data0[i];
+    }
+    std::vector<JoinRow> right_parts;
+    std::vector<int64_t> right_offsets;
+    radix_partition(right, bits1, bits2, right_parts, right_offsets);
+    std::vector<JoinRow>().swap(right);
+
+    std::vector<int> left(keys1, keys1 + n1);
+    std::vector<int> left_parts;
+    std::vector<int64_t> left_offsets;
+    radix_partition(left, bits1, bits2, left_parts, left_offsets);
+    std::vector<int>().swap(left);
+
+    // First pass: build every partition's table and count its matches.
+    // Partition pairs are independent, so they are the threads' morsels.
+    // The builds are small and interleaved with the lookups, so this whole
+    // pass is timed as the probe.
+    timer.next(PHASE_PROBE);
+    std::vector<JoinHashTable> tables(n_parts);
+    std::vector<const JoinHashTable::Slot *> probe_slots(n1);
+    std::vector<int64_t> part_out(n_parts + 1, 0);
+    for_each_morsel(join_config.threads, n_parts, [&](int64_t p) {
+        int64_t right_begin = right_offsets[p];
+        int64_t right_size = right_offsets[p + 1] - right_begin;
+        std::vector<int> part_keys(right_size);
+        for (int64_t j = 0; j < right_size; j++)
+            part_keys[j] = right_parts[right_begin + j].key;
+        tables[p].build(part_keys.data(), right_size);
+
+        tables[p].find_batch(left_parts.data() + left_offsets[p], left_offsets[p + 1] - left_offsets[p],
+                             probe_slots.data() + left_offsets[p]);
+        int64_t count = 0;
+        for (int64_t i = left_offsets[p]; i < left_offsets[p + 1]; i++) {
+            if (probe_slots[i] != NULL)
+                count += probe_slots[i]->count;
+        }
+        part_out[p + 1] = count;
+    });
+    part_out[0] = keys_result.size();
+    for (int64_t p = 0; p < n_parts; p++)
+        part_out[p + 1] += part_out[p];
+    JOIN_STAT(for (int64_t p = 0; p < n_parts; p++) record_table(tables[p]));
+
+    // Second pass: write matches directly into exactly sized outputs
+    timer.next(PHASE_MATERIALIZE);
+    keys_result.resize(part_out[n_parts]);
+    data0_result.resize(part_out[n_parts]);
+    data1_result.resize(part_out[n_parts]);
+    for_each_morsel(join_config.threads, n_parts, [&](int64_t p) {
+        const JoinRow *part_rows = right_parts.data() + right_offsets[p];
+        int64_t out = part_out[p];
+        for (int64_t i = left_offsets[p]; i < left_offsets[p + 1]; i++) {
+            const JoinHashTable::Slot *slot = probe_slots[i];
+            if (slot == NULL)
+                continue;
+            for (int64_t j = slot->start; j < slot->start + slot->count; j++, out++) {
+                const JoinRow &row = part_rows[tables[p].rows[j]];
+                keys_result[out] = left_parts[i];
+                data0_result[out] = row.data0;
+                data1_result[out] = row.data1;
+            }
+        }
+    });
+}
+
+// SORT-MERGE JOIN
+
+/**
+ * @brief Map an int32 key to an unsigned value with the same ordering.
+ */
+static inline uint32_t sort_bits(int key)
+{
+    return static_cast<uint32_t>(key) ^ 0x80000000U;
+}
+
+/**
+ * @brief Sort elements by key with an LSD radix sort (4 passes of 8 bits).
+ * Passes where every element has the same digit are skipped, and the sort
+ * returns right away if the input is already sorted.
+ *
+ * @param[in,out] v Elements to sort
+ */
+template <typename T>
+static void lsd_radix_sort(std::vector<T> &v)
+{
+    int64_t n = v.size();
+    bool sorted = true;
+    for (int64_t i = 1; i < n && sorted; i++)
+        sorted = !(row_key(v[i]) < row_key(v[i - 1]));
+    if (sorted)
+        return;
+
+    std::vector<T> tmp(n);
+    for (int shift = 0; shift < 32; shift += 8) {
+        int64_t dst[257] = {0};
+        for (int64_t i = 0; i < n; i++)
+            dst[((sort_bits(row_key(v[i])) >> shift) & 0xFF) + 1]++;
+        if (*std::max_element(dst + 1, dst + 257) == n)
+            continue;
+        for (int d = 0; d < 256; d++)
+            dst[d + 1] += dst[d];
+        for (int64_t i = 0; i < n; i++)
+            tmp[dst[(sort_bits(row_key(v[i])) >> shift) & 0xFF]++] = v[i];
+        v.swap(tmp);
+    }
+}
+
+/**
+ * @brief Sort-merge join of the left keys with the right table.
+ * keys1 and the right table rows are radix sorted by key, then merged; every
+ * run of equal keys on the left is joined with the matching run on the
+ * right. Matches are appended to the output columns in key order.
+ */
+static void sort_merge_join(const int *keys1, int64_t n1, const int *keys2, const double *data0,
+                            const int *data1, int64_t n2, std::vector<int> &keys_result,
+                            std::vector<double> &data0_result, std::vector<int> &data1_result)
+{
+    PhaseTimer timer(PHASE_BUILD);
+    std::vector<int> left(keys1, keys1 + n1);
+    lsd_radix_sort(left);
+    std::vector<JoinRow> right(n2);
+    for (int64_t i = 0; i < n2; i++) {
+        right[i].key = keys2[i];
+        right[i].data1 = data1[i];
+        right[i].data0 = data0[i];
+    }
+    lsd_radix_sort(right);
+
+    // First pass: find the matching runs of both sides and count the output size
+    timer.next(PHASE_PROBE);
+    struct Run {
+        int64_t left_begin, left_end, right_begin, right_end;
+    };
+    std::vector<Run> runs;
+    int64_t n_out = 0;
+    int64_t i = 0, j = 0;
+    while (i < n1 && j < n2) {
+        if (left[i] < right[j].key) {
+            i++;
+        } else if (right[j].key < left[i]) {
+            j++;
+        } else {
+            Run run = {i, i, j, j};
+            while (run.left_end < n1 && left[run.left_end] == left[i])
+                run.left_end++;
+            while (run.right_end < n2 && right[run.right_end].key == left[i])
+                run.right_end++;
+            n_out += (run.left_end - run.left_begin) * (run.right_end - run.right_begin);
+            runs.push_back(run);
+            i = run.left_end;
+            j = run.right_end;
+        }
+    }
+
+    // Second pass: write the cross product of every run pair
+    timer.next(PHASE_MATERIALIZE);
+    int64_t out = keys_result.size();
+    keys_result.resize(out + n_out);
+    data0_result.resize(out + n_out);
+    data1_result.resize(out + n_out);
+    for (size_t r = 0; r < runs.size(); r++) {
+        for (int64_t l = runs[r].left_begin; l < runs[r].left_end; l++) {
+            for (int64_t k = runs[r].right_begin; k < runs[r].right_end; k++, out++) {
+                keys_result[out] = right[k].key;
+                data0_result[out] = right[k].data0;
+                data1_result[out] = right[k].data1;
+            }
+        }
+    }
+}
+
+// DENSE ARRAY JOIN
+
+/**
+ * @brief Range spanned by a key column.
+ *
+ * @param keys Key column
+ * @param n Number of keys (at least 1)
+ * @param[out] min_key Smallest key
+ * @return int64_t Number of values in [min_key, max_key]
+ */
+static int64_t key_range(const int *keys, int64_t n, int &min_key)
+{
+    std::pair<const int *, const int *> bounds = std::minmax_element(keys, keys + n);
+    min_key = *bounds.first;
+    return int64_t(*bounds.second) - *bounds.first + 1;
+}
+
+/**
+ * @brief Direct-addressed join for right tables whose keys span a small
+ * range [min_key, min_key + range). The right rows are counting sorted by
+ * key, and rows offsets[key - min_key] to offsets[key - min_key + 1] - 1
+ * hold the key's run, so a lookup is two array reads and no hashing.
+ * The probe counts and then writes the matches over morsels of the left
+ * keys (see probe_two_pass). Matches are appended to the output columns.
+ */
+static void dense_join(const int *keys1, int64_t n1, const int *keys2, const double *data0,
+                       const int *data1, int64_t n2, int min_key, int64_t range,
+                       std::vector<int> &keys_result, std::vector<double> &data0_result,
+                       std::vector<int> &data1_result)
+{
+    // Counting sort of the right rows by key
+    PhaseTimer timer(PHASE_BUILD);
+    std::vector<int64_t> offsets(range + 1, 0);
+    for (int64_t i = 0; i < n2; i++)
+        offsets[int64_t(keys2[i]) - min_key + 1]++;
+    for (int64_t k = 0; k < range; k++)
+        offsets[k + 1] += offsets[k];
+    std::vector<int64_t> cursor(offsets.begin(), offsets.end() - 1);
+    std::vector<JoinRow> rows(n2);
+    for (int64_t i = 0; i < n2; i++) {
+        JoinRow &row = rows[cursor[int64_t(keys2[i]) - min_key]++];
+        row.key = keys2[i];
+        row.data1 = data1[i];
+        row.data0 = data0[i];
+    }
+
+    // First pass: count the output size of every morsel
+    timer.next(PHASE_PROBE);
+    int64_t n_morsels = (n1 + MORSEL_ROWS - 1) / MORSEL_ROWS;
+    std::vector<int64_t> morsel_out(n_morsels + 1, 0);
+    for_each_morsel(join_config.threads, n_morsels, [&](int64_t m) {
+        int64_t count = 0;
+        for (int64_t i = m * MORSEL_ROWS; i < std::min(n1, (m + 1) * MORSEL_ROWS); i++) {
+            uint64_t k = uint64_t(int64_t(keys1[i]) - min_key);
+            if (k < uint64_t(range))
+                count += offsets[k + 1] - offsets[k];
+        }
+        morsel_out[m + 1] = count;
+    });
+    morsel_out[0] = keys_result.size();
+    for (int64_t m = 0; m < n_morsels; m++)
+        morsel_out[m + 1] += morsel_out[m];
+
+    // Second pass: copy the run of every left key
+    timer.next(PHASE_MATERIALIZE);
+    keys_result.resize(morsel_out[n_morsels]);
+    data0_result.resize(morsel_out[n_morsels]);
+    data1_result.resize(morsel_out[n_morsels]);
+    for_each_morsel(join_config.threads, n_morsels, [&](int64_t m) {
+        int64_t out = morsel_out[m];
+        for (int64_t i = m * MORSEL_ROWS; i < std::min(n1, (m + 1) * MORSEL_ROWS); i++) {
+            uint64_t k = uint64_t(int64_t(keys1[i]) - min_key);
+            if (k >= uint64_t(range))
+                continue;
+            for (int64_t j = offsets[k]; j < offsets[k + 1]; j++, out++) {
+                keys_result[out] = rows[j].key;
+                data0_result[out] = rows[j].data0;
+                data1_result[out] = rows[j].data1;
+            }
+        }
+    });
+}
+
+// PARTITIONING
+
+/**
+ * @brief Shuffle partition of a key, in [0, n_partitions), with the
+ * `join_config.partitioner` hash. The hashes are independent of hash_key()
+ * and mix_key(), so the keys that end up on one rank still spread over its
+ * hash table slots and radix partitions.
+ */
+static inline int key_partition(int key, int n_partitions)
+{
+    switch (join_config.partitioner) {
+    case PARTITION_MULTIPLICATIVE: {
+        uint32_t h = static_cast<uint32_t>(key) * 0xCC9E2D51U;
+        return (uint64_t(h) * n_partitions) >> 32;
+    }
+    case PARTITION_MURMUR: {
+        uint64_t h = static_cast<uint32_t>(key);
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ULL;
+        h ^= h >> 33;
+        return ((h >> 32) * n_partitions) >> 32;
+    }
+    default: {
+        // C++ % keeps the sign of negative keys
+        int p = key % n_partitions;
+        return p < 0 ? p + n_partitions : p;
+    }
+    }
+}
+
+/**
+ * @brief Owner rank of every shuffle partition. Both tables of a join must be
+ * shuffled with the same map.
+ */
+struct PartitionMap {
+    int n_partitions;
+    std::vector<int> owner;
+
+    PartitionMap() : n_partitions(0) {}
+
+    /** @brief Rank the rows with key `key` are shuffled to. */
+    int rank_of(int key) const { return owner[key_partition(key, n_partitions)]; }
+};
+
+/**
+ * @brief Partition map without looking at the data: `join_config.partitions`
+ * partitions (at least one per rank), dealt out to the ranks round-robin.
+ * Local, for joins that cannot see both tables up front (streaming_join).
+ */
+static void default_partitions(PartitionMap &map)
+{
+    map.n_partitions = std::max(join_config.partitions, n_pes);
+    map.owner.resize(map.n_partitions);
+    for (int v = 0; v < map.n_partitions; v++)
+        map.owner[v] = v % n_pes;
+}
+
+/**
+ * @brief Partition map of a join. With one partition per rank this is
+ * default_partitions. With more (over-partitioning), the global row count of
+ * every partition over both tables is summed with MPI_Allreduce, and the
+ * partitions are assigned largest first to the least loaded rank, so ranks
+ * get similar numbers of rows even if keys collide on few partitions (e.g.
+ * strided keys with the modulo partitioner). Collective if there are more
+ * partitions than ranks.
+ *
+ * @param keys1 Join key column in the first table (chunk on this rank)
+ * @param keys2 Join key column in the second table (chunk on this rank)
+ * @param[out] map Partition map, the same on every rank
+ */
+static void assign_partitions(const std::vector<int> &keys1, const std::vector<int> &keys2, PartitionMap &map)
+{
+    default_partitions(map);
+    const int P = map.n_partitions;
+    if (P == n_pes)
+        return;
+
+    PhaseTimer timer(PHASE_COUNTS);
+    std::vector<int64_t> local(P, 0);
+    for (size_t i = 0; i < keys1.size(); i++)
+        local[key_partition(keys1[i], P)]++;
+    for (size_t i = 0; i < keys2.size(); i++)
+        local[key_partition(keys2[i], P)]++;
+    std::vector<int64_t> rows(P);
+    allreduce_sum_int64(local.data(), rows.data(), P);
+
+    // Longest processing time first, ties by partition and rank so every rank gets the same map
+    std::vector<int> order(P);
+    for (int v = 0; v < P; v++)
+        order[v] = v;
+    std::stable_sort(order.begin(), order.end(), [&rows](int a, int b) { return rows[a] > rows[b]; });
+    typedef std::pair<int64_t, int> Load; // rows, rank
+    std::priority_queue<Load, std::vector<Load>, std::greater<Load> > loads;
+    for (int p = 0; p < n_pes; p++)
+        loads.push(Load(0, p));
+    for (int i = 0; i < P; i++) {
+        Load least = loads.top();
+        loads.pop();
+        map.owner[order[i]] = least.second;
+        least.first += rows[order[i]];
+        loads.push(least);
+    }
+}
+
+// JOIN CONTEXT
+
+/**
+ * @brief Send/receive layout for shuffling one table with MPI_Alltoallv.
+ * Rows are hash partitioned by key (see PartitionMap). Rows that stay on this
+ * rank (the self partition) do not go through MPI: they are scattered
+ * straight into the receive side at `recv_disp[rank]`, and the self entries
+ * of `send_counts`/`recv_counts` are 0.
+ * `send_pos[i]` is the position of local row i in the send buffer if it is
+ * below `n_send`, `n_send + j` if it is the j-th row of the self partition,
+ * or -1 if the row is not shuffled.
+ */
+struct ShufflePlan {
+    std::vector<int64_t> send_counts;
+    std::vector<int64_t> send_disp;
+    std::vector<int64_t> recv_counts;
+    std::vector<int64_t> recv_disp;
+    std::vector<int64_t> send_pos;
+    int64_t n_send; // rows sent to other ranks
+    int64_t n_self; // rows of the self partition
+    int64_t n_recv; // rows on the receive side, including the self partition
+};
+
+// allocations from which JoinContext buffers ask for huge pages
+static const size_t HUGE_PAGE_BYTES = size_t(2) << 20;
+
+/**
+ * @brief Ask the kernel to back the whole huge pages inside [data, data + bytes)
+ * with transparent huge pages (`join_config.huge_pages`, Linux only).
+ * Memory that is already touched keeps its pages.
+ */
+static void advise_huge_pages(void *data, size_t bytes)
+{
+#ifdef MADV_HUGEPAGE
+    if (!join_config.huge_pages || bytes < HUGE_PAGE_BYTES)
+        return;
+    uintptr_t begin = (reinterpret_cast<uintptr_t>(data) + HUGE_PAGE_BYTES - 1) & ~(HUGE_PAGE_BYTES - 1);
+    uintptr_t end = (reinterpret_cast<uintptr_t>(data) + bytes) & ~(HUGE_PAGE_BYTES - 1);
+    if (end > begin)
+        madvise(reinterpret_cast<void *>(begin), end - begin, MADV_HUGEPAGE);
+#else
+    (void)data;
+    (void)bytes;
+#endif
+}
+
+/**
+ * @brief Resize a JoinContext buffer to `n` elements. Capacity is only ever
+ * grown, with some headroom so that joins of slightly different sizes reuse
+ * it, and fresh capacity gets huge pages (see advise_huge_pages). The contents
+ * are not kept when the buffer grows.
+ */
+template <typename T>
+static void arena_resize(std::vector<T> &buffer, size_t n)
+{
+    if (n > buffer.capacity()) {
+        buffer.clear();
+        buffer.reserve(n + n / 8);
+        advise_huge_pages(buffer.data(), buffer.capacity() * sizeof(T));
+    }
+    buffer.resize(n);
+}
+
+/**
+ * @brief Buffers of a join: shuffle send and receive buffers, the shuffle
+ * layouts of both tables and the hash table. Passing the same context to
+ * repeated joins reuses its capacity instead of allocating, page faulting
+ * and freeing fresh buffers on every call. Joins that are not given a
+ * context use `default_join_context`. A context must not be used by two
+ * joins at the same time; call release() to give its memory back.
+ */
+struct JoinContext {
+    std::vector<int> keys_send;
+    std::vector<JoinRow> rows_send;
+    std::vector<JoinRow> rows_recv;
+    std::vector<int> keys1_recv;
+    std::vector<int> keys2_recv;
+    std::vector<double> data0_recv;
+    std::vector<int> data1_recv;
+    std::vector<char> bytes_send; // packed or encoded rows
+    std::vector<char> bytes_recv;
+    ShufflePlan left_plan;
+    ShufflePlan right_plan;
+    PartitionMap partitions;
+    JoinHashTable table;
+
+    void release()
+    {
+        std::vector<int>().swap(keys_send);
+        std::vector<JoinRow>().swap(rows_send);
+        std::vector<JoinRow>().swap(rows_recv);
+        std::vector<int>().swap(keys1_recv);
+        std::vector<int>().swap(keys2_recv);
+        std::vector<double>().swap(data0_recv);
+        std::vector<int>().swap(data1_recv);
+        std::vector<char>().swap(bytes_send);
+        std::vector<char>().swap(bytes_recv);
+        left_plan = ShufflePlan();
+        right_plan = ShufflePlan();
+        partitions = PartitionMap();
+        table = JoinHashTable();
+    }
+};
+
+JoinContext default_join_context;
+
+// JOIN IMPLEMENTATIONS
+
+/**
+ * @brief Performant implementation of local join.
+ * The left table only has the key column (keys1) which needs
+ * to be joined with the first column (keys2) in the right table.
+ * data0 and data1 are the 2nd and 3rd columns in the right table.
+ * A hash table is built over keys2 and probed with keys1, so every
+ * (keys1, keys2) match is emitted including duplicates on both sides.
+ * Right tables of at least `join_config.radix_min_rows` rows use the
+ * radix partitioned join by default, inputs that are both already
+ * sorted use the sort-merge join when running on a single thread (it is
+ * serial), and smaller right tables whose keys span
+ * at most `join_config.dense_max_factor` values per row use the dense
+ * array join (see `join_config.engine`). The dense join is only ever used
+ * within that bound, even when forced: wider key ranges use the hash join.
+ * The output overwrites the caller's columns in place: their previous
+ * contents are dropped but their capacity is kept, so repeated joins into
+ * the same columns do not allocate. They must not alias any input.
+ *
+ * @param keys1 Join key column in the first table
+ * @param keys2 Join key column in the second table
+ * @param data0 First data column in the second table
+ * @param data1 Second data data column in the second table
+ * @param[out] keys_out Output key column
+ * @param[out] data0_out Output first data column
+ * @param[out] data1_out Output second data column
+ * @param context Buffers to reuse (default_join_context if NULL)
+ * @param type Join type. Types other than inner always use the hash join;
+ *  semi and anti joins only output keys, count joins nothing.
+ * @return int64_t Number of output rows, or for JOIN_COUNT the number of
+ *  matching row pairs
+ */
+int64_t local_join_into(const std::vector<int> &keys1, const std::vector<int> &keys2,
+                        const std::vector<double> &data0, const std::vector<int> &data1,
+                        std::vector<int> &keys_out, std::vector<double> &data0_out, std::vector<int> &data1_out,
+                        JoinContext *context = NULL, JoinType type = JOIN_INNER)
+{
+    if (type != JOIN_INNER) {
+        keys_out.clear();
+        data0_out.clear();
+        data1_out.clear();
+        int64_t result = hash_join_typed(type, keys1.data(), keys1.size(), keys2.data(), data0.data(), data1.data(),
+                                         keys2.size(), keys_out, data0_out, data1_out,
+                                         (context ? *context : default_join_context).table);
+        JOIN_STAT(join_stats.probe_rows += keys1.size(); join_stats.output_rows += keys_out.size());
+        return result;
+    }
+
+    JoinEngine engine = join_config.engine;
+    if (engine == JOIN_ENGINE_AUTO) {
+        // The sort-merge join is serial, so it only wins on a single thread
+        if (join_config.threads == 1 && std::is_sorted(keys1.begin(), keys1.end()) &&
+            std::is_sorted(keys2.begin(), keys2.end()))
+            engine = JOIN_ENGINE_SORT_MERGE;
+        else if ((int64_t)keys2.size() >= join_config.radix_min_rows)
+            engine = JOIN_ENGINE_RADIX;
+        else
+            engine = JOIN_ENGINE_DENSE;
+    }
+    int min_key = 0;
+    int64_t range = 0;
+    if (engine == JOIN_ENGINE_DENSE) {
+        // A dense join over a wide key range would allocate the whole range
+        range = keys2.empty() ? 0 : key_range(keys2.data(), keys2.size(), min_key);
+        if (keys2.empty() || range > join_config.dense_max_factor * (int64_t)keys2.size())
+            engine = JOIN_ENGINE_HASH;
+    }
+
+    // The engines append to the output columns
+    keys_out.clear();
+    data0_out.clear();
+    data1_out.clear();
+    if (engine == JOIN_ENGINE_DENSE)
+        dense_join(keys1.data(), keys1.size(), keys2.data(), data0.data(), data1.data(), keys2.size(),
+                   min_key, range, keys_out, data0_out, data1_out);
+    else if (engine == JOIN_ENGINE_SORT_MERGE)
+        sort_merge_join(keys1.data(), keys1.size(), keys2.data(), data0.data(), data1.data(), keys2.size(),
+                        keys_out, data0_out, data1_out);
+    else if (engine == JOIN_ENGINE_RADIX)
+        radix_join(keys1.data(), keys1.size(), keys2.data(), data0.data(), data1.data(), keys2.size(),
+                   keys_out, data0_out, data1_out);
+    else
+        hash_join(keys1.data(), keys1.size(), keys2.data(), data0.data(), data1.data(), keys2.size(),
+                  keys_out, data0_out, data1_out, (context ? *context : default_join_context).table);
+    JOIN_STAT(join_stats.probe_rows += keys1.size(); join_stats.output_rows += keys_out.size());
+    return keys_out.size();
+}
+
+/**
+ * @brief Same as local_join_into, with the output returned in new columns.
+ * The columns are moved into the tuple, and from there they can be moved
+ * out again (e.g. with std::get<0>(std::move(output))), so the output is
+ * never copied.
+ *
+ * @param keys1 Join key column in the first table
+ * @param keys2 Join key column in the second table
+ * @param data0 First data column in the second table
+ * @param data1 Second data data column in the second table
+ * @param context Buffers to reuse (default_join_context if NULL)
+ * @param type Join type (see local_join_into)
+ * @return std::tuple<std::vector<int>, std::vector<double>, std::vector<int>>
+ *  Resulting distributed output (key and data columns from the right table)
+ */
+std::tuple<std::vector<int>, std::vector<double>, std::vector<int>> local_join_impl(
+    const std::vector<int> &keys1,
+    const std::vector<int> &keys2, const std::vector<double> &data0, const std::vector<int> &data1,
+    JoinContext *context = NULL, JoinType type = JOIN_INNER)
+{
+    std::vector<int> keys_result;
+    std::vector<double> data0_result;
+    std::vector<int> data1_result;
+    local_join_into(keys1, keys2, data0, data1, keys_result, data0_result, data1_result, context, type);
+    return std::make_tuple(std::move(keys_result), std::move(data0_result), std::move(data1_result));
+}
+
+// NODE-AWARE SHUFFLE
+
+/**
+ * @brief Buffer in an MPI-3 shared memory window: every rank of a node owns
+ * one segment, and can read and write the segments of the other ranks of
+ * its node directly. Segments only grow, with some headroom.
+ */
+struct SharedSegment {
+    MPI_Win win;
+    char *base;
+    MPI_Aint capacity;
+    std::vector<char *> peer; // segment of every rank of the node
+
+    SharedSegment() : win(MPI_WIN_NULL), base(NULL), capacity(0) {}
+
+    /**
+     * @brief Make this rank's segment at least `bytes` long (collective over
+     * `comm`, the node). Contents are lost if any segment of the node grows;
+     * the segments that were large enough keep their size.
+     * Also synchronizes the node: no rank returns before all ranks are done
+     * with the previous contents.
+     */
+    void reserve(MPI_Comm comm, MPI_Aint bytes)
+    {
+        int grow = bytes > capacity || win == MPI_WIN_NULL;
+        MPI_Allreduce(MPI_IN_PLACE, &grow, 1, MPI_INT, MPI_MAX, comm);
+        if (!grow)
+            return;
+        release();
+        // Only the ranks that outgrew their segment take the 1/8 headroom
+        if (bytes > capacity)
+            capacity = bytes + bytes / 8;
+        MPI_Info info;
+        MPI_Info_create(&info);
+        MPI_Info_set(info, "alloc_shared_noncontig", "true");
+        MPI_Win_allocate_shared(capacity, 1, info, comm, &base, &win);
+        MPI_Info_free(&info);
+        MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+
+        int size;
+        MPI_Comm_size(comm, &size);
+        peer.assign(size, NULL);
+        for (int l = 0; l < size; l++) {
+            MPI_Aint peer_bytes;
+            int disp_unit;
+            MPI_Win_shared_query(win, l, &peer_bytes, &disp_unit, &peer[l]);
+        }
+    }
+
+    /** @brief Free the window (collective over the node). */
+    void release()
+    {
+        if (win == MPI_WIN_NULL)
+            return;
+        MPI_Win_unlock_all(win);
+        MPI_Win_free(&win);
+        base = NULL;
+    }
+};
+
+/**
+ * @brief Ranks grouped by node (the ranks sharing memory, see
+ * JOIN_NODE_RANKS), with the communicators and shared buffers of
+ * node_alltoallv. Set up on first use.
+ */
+struct NodeShuffle {
+    bool ready;
+    MPI_Comm node_comm;   // ranks of this node
+    MPI_Comm leader_comm; // first rank of every node, MPI_COMM_NULL on the others
+    int local_rank;
+    int local_size;
+    int node;
+    int n_nodes;
+    std::vector<int> node_of;                // node of every rank
+    std::vector<int> local_of;               // local rank of every rank in its node
+    std::vector<std::vector<int> > node_ranks; // ranks of every node, by local rank
+    SharedSegment outbox; // every rank: its counts and the rows for its own node
+    SharedSegment pack;   // leader: rows for the other nodes
+    SharedSegment inbox;  // leader: rows from the other nodes
+
+    NodeShuffle() : ready(false), node_comm(MPI_COMM_NULL), leader_comm(MPI_COMM_NULL) {}
+};
+
+NodeShuffle node_shuffle;
+
+/**
+ * @brief Set up node_shuffle, if not done yet (collective).
+ */
+static NodeShuffle &node_topology()
+{
+    NodeShuffle &ns = node_shuffle;
+    if (ns.ready)
+        return ns;
+    MPI_Comm shared_comm;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &shared_comm);
+    if (join_config.node_ranks > 0) {
+        int shared_rank;
+        MPI_Comm_rank(shared_comm, &shared_rank);
+        MPI_Comm_split(shared_comm, shared_rank / join_config.node_ranks, rank, &ns.node_comm);
+        MPI_Comm_free(&shared_comm);
+    } else {
+        ns.node_comm = shared_comm;
+    }
+    MPI_Comm_rank(ns.node_comm, &ns.local_rank);
+    MPI_Comm_size(ns.node_comm, &ns.local_size);
+    MPI_Comm_split(MPI_COMM_WORLD, ns.local_rank == 0 ? 0 : MPI_UNDEFINED, rank, &ns.leader_comm);
+    if (ns.local_rank == 0) {
+        MPI_Comm_rank(ns.leader_comm, &ns.node);
+        MPI_Comm_size(ns.leader_comm, &ns.n_nodes);
+    }
+    MPI_Bcast(&ns.node, 1, MPI_INT, 0, ns.node_comm);
+    MPI_Bcast(&ns.n_nodes, 1, MPI_INT, 0, ns.node_comm);
+
+    int mine[2] = {ns.node, ns.local_rank};
+    std::vector<int> all(2 * n_pes);
+    allgather_int(mine, 2, all.data());
+    ns.node_of.resize(n_pes);
+    ns.local_of.resize(n_pes);
+    ns.node_ranks.assign(ns.n_nodes, std::vector<int>());
+    for (int p = 0; p < n_pes; p++) {
+        ns.node_of[p] = all[2 * p];
+        ns.local_of[p] = all[2 * p + 1];
+        std::vector<int> &ranks = ns.node_ranks[ns.node_of[p]];
+        if ((int)ranks.size() <= ns.local_of[p])
+            ranks.resize(ns.local_of[p] + 1);
+        ranks[ns.local_of[p]] = p;
+    }
+    ns.ready = true;
+    return ns;
+}
+
+/**
+ * @brief Free the communicators and shared windows of node_shuffle
+ * (collective, call before MPI_Finalize if JOIN_HIERARCHICAL was used).
+ */
+void release_node_shuffle()
+{
+    NodeShuffle &ns = node_shuffle;
+    if (!ns.ready)
+        return;
+    ns.outbox.release();
+    ns.pack.release();
+    ns.inbox.release();
+    if (ns.leader_comm != MPI_COMM_NULL)
+        MPI_Comm_free(&ns.leader_comm);
+    MPI_Comm_free(&ns.node_comm);
+    ns = NodeShuffle();
+}
+
+/**
+ * @brief Make the shared window writes of this rank visible to the other
+ * ranks of its node, and theirs to this rank.
+ */
+static void node_sync(NodeShuffle &ns)
+{
+    SharedSegment *segments[3] = {&ns.outbox, &ns.pack, &ns.inbox};
+    for (int i = 0; i < 3; i++) {
+        if (segments[i]->win != MPI_WIN_NULL)
+            MPI_Win_sync(segments[i]->win);
+    }
+    MPI_Barrier(ns.node_comm);
+    for (int i = 0; i < 3; i++) {
+        if (segments[i]->win != MPI_WIN_NULL)
+            MPI_Win_sync(segments[i]->win);
+    }
+}
+
+// offset of the rows in an outbox segment, after the counts and local displacements
+static inline MPI_Aint outbox_data_offset(int local_size)
+{
+    return ((n_pes + local_size) * sizeof(int64_t) + 63) & ~MPI_Aint(63);
+}
+
+/**
+ * @brief Two-level alltoallv, with the same arguments and result as
+ * alltoallv_large. Rows between ranks of the same node go through shared
+ * memory. Rows for other nodes are packed by all ranks of the node, in
+ * parallel, into one message per destination node in a shared window of the
+ * node leader, the leaders exchange these messages with each other (one
+ * MPI_Alltoallv over the leaders), and every rank copies its rows out of its
+ * leader's window. With N nodes this sends N^2 instead of n_pes^2 messages
+ * over the network.
+ *
+ * @param send_buffer Buffer with data to send to all ranks, ordered by destination rank
+ * @param send_counts Number of elements to send to each rank (length `n_pes`)
+ * @param send_disp Displacement of the data for each rank in `send_buffer` (length `n_pes`)
+ * @param[out] recv_buffer Buffer to copy the data into. Make sure that it is appropriately sized.
+ * @param recv_counts Number of elements to receive from each rank (length `n_pes`)
+ * @param recv_disp Displacement in `recv_buffer` of the data from each rank (length `n_pes`)
+ * @param type MPI datatype of the elements (copied as `extent` bytes each)
+ */
+static void node_alltoallv(const void *send_buffer, const std::vector<int64_t> &send_counts,
+                           const std::vector<int64_t> &send_disp, void *recv_buffer,
+                           const std::vector<int64_t> &recv_counts, const std::vector<int64_t> &recv_disp,
+                           MPI_Datatype type)
+{
+    NodeShuffle &ns = node_topology();
+    const int L = ns.local_size;
+    const std::vector<int> &local = ns.node_ranks[ns.node];
+    MPI_Aint lb, extent;
+    MPI_Type_get_extent(type, &lb, &extent);
+    const char *send = static_cast<const char *>(send_buffer);
+    char *recv = static_cast<char *>(recv_buffer);
+
+    // 1. Publish the counts, and the rows for this node, in the outbox
+    const MPI_Aint data_offset = outbox_data_offset(L);
+    int64_t local_rows = 0;
+    for (int l = 0; l < L; l++)
+        local_rows += send_counts[local[l]];
+    ns.outbox.reserve(ns.node_comm, data_offset + local_rows * extent);
+    int64_t *counts = reinterpret_cast<int64_t *>(ns.outbox.base);
+    int64_t *local_disp = counts + n_pes;
+    std::copy(send_counts.begin(), send_counts.end(), counts);
+    int64_t pos = 0;
+    for (int l = 0; l < L; l++) {
+        int p = local[l];
+        local_disp[l] = pos;
+        memcpy(ns.outbox.base + data_offset + pos * extent, send + send_disp[p] * extent, send_counts[p] * extent);
+        pos += send_counts[p];
+    }
+    node_sync(ns);
+
+    // 2. Pack the rows for the other nodes into the leader's window: one message
+    // per destination node, grouped by destination rank, then by local source rank
+    std::vector<int64_t> node_bytes(ns.n_nodes, 0);
+    std::vector<int64_t> node_disp(ns.n_nodes, 0);
+    int64_t my_pos = 0; // where this rank's first row for the current destination goes
+    std::vector<int64_t> my_offset(n_pes, 0);
+    for (int n = 0; n < ns.n_nodes; n++) {
+        if (n > 0)
+            node_disp[n] = node_disp[n - 1] + node_bytes[n - 1];
+        if (n == ns.node)
+            continue;
+        for (size_t d = 0; d < ns.node_ranks[n].size(); d++) {
+            int p = ns.node_ranks[n][d];
+            for (int l = 0; l < L; l++) {
+                const int64_t *peer_counts = reinterpret_cast<const int64_t *>(ns.outbox.peer[l]);
+                if (l == ns.local_rank)
+                    my_pos = node_disp[n] + node_bytes[n];
+                node_bytes[n] += peer_counts[p] * extent;
+            }
+            my_offset[p] = my_pos;
+        }
+    }
+    int64_t pack_bytes = node_disp[ns.n_nodes - 1] + node_bytes[ns.n_nodes - 1];
+    ns.pack.reserve(ns.node_comm, ns.local_rank == 0 ? pack_bytes : 0);
+    for (int p = 0; p < n_pes; p++) {
+        if (ns.node_of[p] != ns.node)
+            memcpy(ns.pack.peer[0] + my_offset[p], send + send_disp[p] * extent, send_counts[p] * extent);
+    }
+    node_sync(ns);
+
+    // 3. Leaders exchange the row counts of every (source, destination) pair,
+    // then the messages, straight into the inbox
+    std::vector<int64_t> matrix_disp(ns.n_nodes + 1, 0);
+    for (int n = 0; n < ns.n_nodes; n++)
+        matrix_disp[n + 1] = matrix_disp[n] + ns.node_ranks[n].size() * L;
+    const MPI_Aint inbox_data = matrix_disp[ns.n_nodes] * sizeof(int64_t);
+    if (ns.local_rank == 0) {
+        std::vector<int64_t> matrices_send(matrix_disp[ns.n_nodes], 0);
+        std::vector<int64_t> matrix_counts(ns.n_nodes);
+        for (int n = 0; n < ns.n_nodes; n++) {
+            matrix_counts[n] = ns.node_ranks[n].size() * L;
+            // matrix for node n: a row per local source, a column per rank of n
+            for (int l = 0; l < L; l++) {
+                const int64_t *peer_counts = reinterpret_cast<const int64_t *>(ns.outbox.peer[l]);
+                for (size_t d = 0; d < ns.node_ranks[n].size(); d++)
+                    matrices_send[matrix_disp[n] + l * ns.node_ranks[n].size() + d] =
+                        n == ns.node ? 0 : peer_counts[ns.node_ranks[n][d]];
+            }
+        }
+        std::vector<int64_t> matrices_recv(matrix_disp[ns.n_nodes]);
+        std::vector<int64_t> matrix_recv_counts(ns.n_nodes);
+        std::vector<int64_t> matrix_recv_disp(ns.n_nodes, 0);
+        for (int n = 0; n < ns.n_nodes; n++) {
+            matrix_recv_counts[n] = ns.node_ranks[n].size() * L;
+            matrix_recv_disp[n] = matrix_disp[n];
+        }
+        std::vector<int64_t> matrix_send_disp(matrix_disp.begin(), matrix_disp.end() - 1);
+        alltoallv_large(matrices_send.data(), matrix_counts, matrix_send_disp, matrices_recv.data(),
+                        matrix_recv_counts, matrix_recv_disp, MPI_INT64_T, ns.leader_comm);
+
+        std::vector<int64_t> recv_bytes(ns.n_nodes, 0);
+        std::vector<int64_t> recv_byte_disp(ns.n_nodes, 0);
+        for (int n = 0; n < ns.n_nodes; n++) {
+            for (int64_t i = matrix_disp[n]; i < matrix_disp[n + 1]; i++)
+                recv_bytes[n] += matrices_recv[i] * extent;
+            if (n > 0)
+                recv_byte_disp[n] = recv_byte_disp[n - 1] + recv_bytes[n - 1];
+        }
+        ns.inbox.reserve(ns.node_comm, inbox_data + recv_byte_disp[ns.n_nodes - 1] + recv_bytes[ns.n_nodes - 1]);
+        std::copy(matrices_recv.begin(), matrices_recv.end(), reinterpret_cast<int64_t *>(ns.inbox.base));
+        node_bytes[ns.node] = 0;
+        alltoallv_large(ns.pack.base, node_bytes, node_disp, ns.inbox.base + inbox_data, recv_bytes,
+                        recv_byte_disp, MPI_BYTE, ns.leader_comm);
+    } else {
+        ns.inbox.reserve(ns.node_comm, 0);
+    }
+    node_sync(ns);
+
+    // 4. Copy out the rows from this node's ranks, then those from the other nodes
+    for (int l = 0; l < L; l++) {
+        int p = local[l];
+        const int64_t *peer_disp = reinterpret_cast<const int64_t *>(ns.outbox.peer[l]) + n_pes;
+        memcpy(recv + recv_disp[p] * extent, ns.outbox.peer[l] + data_offset + peer_disp[ns.local_rank] * extent,
+               recv_counts[p] * extent);
+    }
+    const int64_t *matrices = reinterpret_cast<const int64_t *>(ns.inbox.peer[0]);
+    const char *inbox = ns.inbox.peer[0] + inbox_data;
+    for (int n = 0; n < ns.n_nodes; n++) {
+        // message from node n: grouped by rank of this node, then by source rank of n
+        const int64_t *matrix = matrices + matrix_disp[n];
+        const int S = ns.node_ranks[n].size();
+        for (int d = 0; d < L; d++) {
+            for (int s = 0; s < S; s++) {
+                int64_t bytes = matrix[s * L + d] * extent;
+                if (d == ns.local_rank)
+                    memcpy(recv + recv_disp[ns.node_ranks[n][s]] * extent, inbox, bytes);
+                inbox += bytes;
+            }
+        }
+    }
+    // (the next call's outbox.reserve waits for all ranks to be done with the windows)
+}
+
+/**
+ * @brief Alltoallv of the shuffle: two-level through the node leaders with
+ * JOIN_HIERARCHICAL (see node_alltoallv), one flat MPI_Alltoallv otherwise
+ * (see alltoallv_large). Same arguments as alltoallv_large.
+ */
+static void shuffle_alltoallv(void *send_buffer, std::vector<int64_t> &send_counts, std::vector<int64_t> &send_disp,
+                              void *recv_buffer, std::vector<int64_t> &recv_counts, std::vector<int64_t> &recv_disp,
+                              MPI_Datatype type)
+{
+    if (join_config.hierarchical_shuffle && n_pes > 1)
+        node_alltoallv(send_buffer, send_counts, send_disp, recv_buffer, recv_counts, recv_disp, type);
+    else
+        alltoallv_large(send_buffer, send_counts, send_disp, recv_buffer, recv_counts, recv_disp, type);
+}
+
+/**
+ * @brief Same as shuffle_alltoallv, except for packed rows of `row_bytes`
+ * bytes each (counts and displacements are in rows).
+ */
+static void shuffle_alltoallv_bytes(char *send_buffer, std::vector<int64_t> &send_counts,
+                                    std::vector<int64_t> &send_disp, char *recv_buffer,
+                                    std::vector<int64_t> &recv_counts, std::vector<int64_t> &recv_disp, int row_bytes)
+{
+    MPI_Datatype type;
+    MPI_Type_contiguous(row_bytes, MPI_BYTE, &type);
+    MPI_Type_commit(&type);
+    shuffle_alltoallv(send_buffer, send_counts, send_disp, recv_buffer, recv_counts, recv_disp, type);
+    MPI_Type_free(&type);
+}
+
+// SHUFFLE
+
+#ifdef JOIN_STATS
+/**
+ * @brief Count the bytes of a shuffle with `row_bytes` per row in `join_stats`
+ * (JOIN_STATS builds).
+ */
+static void record_shuffle_bytes(const ShufflePlan &plan, int64_t row_bytes)
+{
+    join_stats.bytes_sent += plan.n_send * row_bytes;
+    join_stats.bytes_recv += (plan.n_recv - plan.n_self) * row_bytes;
+}
+#endif
+
+/**
+ * @brief Local half of a shuffle layout: group the rows by destination.
+ * `send_pos` must hold the destination rank of every local row (or -1 for
+ * rows that are not shuffled), and is replaced by the row positions; the
+ * receive side is left to exchange_shuffle_counts.
+ *
+ * @param[in,out] plan Shuffle layout, only `send_pos` is read
+ */
+static void layout_shuffle_plan(ShufflePlan &plan)
+{
+    int64_t n = plan.send_pos.size();
+    plan.send_counts.assign(n_pes, 0);
+    plan.send_disp.assign(n_pes, 0);
+    for (int64_t i = 0; i < n; i++) {
+        if (plan.send_pos[i] >= 0)
+            plan.send_counts[plan.send_pos[i]]++;
+    }
+
+    // The self partition keeps its place in the receive layout but is not sent
+    plan.n_self = plan.send_counts[rank];
+    plan.send_counts[rank] = 0;
+    for (int p = 1; p < n_pes; p++)
+        plan.send_disp[p] = plan.send_disp[p - 1] + plan.send_counts[p - 1];
+    plan.n_send = plan.send_disp[n_pes - 1] + plan.send_counts[n_pes - 1];
+
+    std::vector<int64_t> cursor(plan.send_disp);
+    cursor[rank] = plan.n_send;
+    for (int64_t i = 0; i < n; i++) {
+        if (plan.send_pos[i] >= 0)
+            plan.send_pos[i] = cursor[plan.send_pos[i]]++;
+    }
+}
+
+/**
+ * @brief Exchange the per-destination counts of a layout from
+ * layout_shuffle_plan with every rank and compute its receive side.
+ * Optionally, a second per-destination value (e.g. the size of an encoded
+ * partition) travels in the same MPI_Alltoall.
+ *
+ * @param[in,out] plan Shuffle layout
+ * @param send_extra Optional value sent to every rank
+ * @param[out] recv_extra Optional value received from every rank
+ */
+static void exchange_shuffle_counts(ShufflePlan &plan, const std::vector<int64_t> *send_extra = NULL,
+                                    std::vector<int64_t> *recv_extra = NULL)
+{
+    PhaseTimer timer(PHASE_COUNTS);
+    const int width = send_extra != NULL ? 2 : 1;
+    std::vector<int64_t> send(width * n_pes);
+    std::vector<int64_t> recv(width * n_pes);
+    for (int p = 0; p < n_pes; p++) {
+        send[width * p] = plan.send_counts[p];
+        if (send_extra != NULL)
+            send[width * p + 1] = (*send_extra)[p];
+    }
+    if (join_config.hierarchical_shuffle && n_pes > 1) {
+        std::vector<int64_t> counts(n_pes, width);
+        std::vector<int64_t> disp(n_pes);
+        for (int p = 0; p < n_pes; p++)
+            disp[p] = width * p;
+        node_alltoallv(send.data(), counts, disp, recv.data(), counts, disp, MPI_INT64_T);
+    } else {
+        alltoall_int64(send.data(), width, recv.data());
+    }
+
+    plan.recv_counts.assign(n_pes, 0);
+    plan.recv_disp.assign(n_pes, 0);
+    if (recv_extra != NULL)
+        recv_extra->assign(n_pes, 0);
+    for (int p = 0; p < n_pes; p++) {
+        plan.recv_counts[p] = recv[width * p];
+        if (recv_extra != NULL)
+            (*recv_extra)[p] = recv[width * p + 1];
+    }
+    plan.recv_counts[rank] = plan.n_self;
+    for (int p = 1; p < n_pes; p++)
+        plan.recv_disp[p] = plan.recv_disp[p - 1] + plan.recv_counts[p - 1];
+    plan.n_recv = plan.recv_disp[n_pes - 1] + plan.recv_counts[n_pes - 1];
+    plan.recv_counts[rank] = 0;
+    JOIN_STAT(record_shuffle_rows(plan.send_counts, plan.recv_counts, plan.n_self));
+}
+
+/**
+ * @brief Complete a shuffle layout whose `send_pos` holds the destination
+ * rank of every local row (or -1 for rows that are not shuffled), and
+ * exchange the per-destination counts with every rank.
+ *
+ * @param[in,out] plan Shuffle layout, only `send_pos` is read
+ */
+static void finish_shuffle_plan(ShufflePlan &plan)
+{
+    layout_shuffle_plan(plan);
+    exchange_shuffle_counts(plan);
+}
+
+/**
+ * @brief Compute the shuffle layout of a table from its key column and
+ * exchange the per-destination counts with every rank.
+ *
+ * @param keys Key column of the table (chunk on this rank)
+ * @param partitions Owner rank of every partition (the same for both tables)
+ * @param[out] plan Shuffle layout for this table
+ * @param skip_keys Optional set of keys whose rows are not shuffled
+ * @param exchange Whether to exchange the counts, otherwise only the local
+ *  layout is computed (see exchange_shuffle_counts)
+ */
+static void make_shuffle_plan(const std::vector<int> &keys, const PartitionMap &partitions, ShufflePlan &plan,
+                              const JoinHashTable *skip_keys = NULL, bool exchange = true)
+{
+    int64_t n = keys.size();
+    {
+        PhaseTimer timer(PHASE_PACK);
+        arena_resize(plan.send_pos, n);
+
+        // send_pos holds the destination until the displacements are known
+        for (int64_t i = 0; i < n; i++) {
+            if (skip_keys != NULL && skip_keys->find(keys[i]) != NULL)
+                plan.send_pos[i] = -1;
+            else
+                plan.send_pos[i] = partitions.rank_of(keys[i]);
+        }
+        layout_shuffle_plan(plan);
+    }
+    if (exchange)
+        exchange_shuffle_counts(plan);
+}
+
+/**
+ * @brief Scatter a column following `plan`: rows for other ranks go to the
+ * send buffer, and rows of the self partition directly into the receive side.
+ *
+ * @param col Column to scatter (chunk on this rank)
+ * @param plan Shuffle layout of the table the column belongs to
+ * @param[out] send Send buffer, rows grouped by destination rank (`plan.n_send` elements)
+ * @param[out] recv Receive side of the column (`plan.n_recv` elements)
+ */
+template <typename T>
+static void scatter_column(const std::vector<T> &col, const ShufflePlan &plan, T *send, T *recv)
+{
+    int64_t self_base = plan.recv_disp[rank] - plan.n_send;
+    for (size_t i = 0; i < col.size(); i++) {
+        int64_t pos = plan.send_pos[i];
+        if (pos < 0)
+            continue;
+        if (pos < plan.n_send)
+            send[pos] = col[i];
+        else
+            recv[self_base + pos] = col[i];
+    }
+}
+
+/**
+ * @brief Shuffle an int column according to `plan`.
+ *
+ * @param col Column to shuffle (chunk on this rank)
+ * @param plan Shuffle layout of the table the column belongs to
+ * @param[out] recv Rows of the column received by this rank
+ * @param context Buffers to reuse for the send side
+ */
+static void shuffle_column(const std::vector<int> &col, ShufflePlan &plan, std::vector<int> &recv,
+                           JoinContext &context)
+{
+    PhaseTimer timer(PHASE_PACK);
+    std::vector<int> &send = context.keys_send;
+    arena_resize(send, plan.n_send);
+    arena_resize(recv, plan.n_recv);
+    scatter_column(col, plan, send.data(), recv.data());
+    timer.next(PHASE_ALLTOALLV);
+    shuffle_alltoallv(send.data(), plan.send_counts, plan.send_disp,
+                      recv.data(), plan.recv_counts, plan.recv_disp, MPI_INT);
+    JOIN_STAT(record_shuffle_bytes(plan, sizeof(int)));
+}
+
+/**
+ * @brief Pack the right table following `plan`: rows for other ranks go to
+ * the JoinRow send buffer, and rows of the self partition directly into the
+ * (presized) received columns.
+ *
+ * @param keys Key column of the right table (chunk on this rank)
+ * @param data0 First data column of the right table (chunk on this rank)
+ * @param data1 Second data column of the right table (chunk on this rank)
+ * @param plan Shuffle layout of the right table
+ * @param[out] send Send buffer, rows grouped by destination rank (`plan.n_send` rows)
+ * @param[out] keys_recv Received key column
+ * @param[out] data0_recv Received first data column
+ * @param[out] data1_recv Received second data column
+ */
+static void pack_rows(const std::vector<int> &keys, const std::vector<double> &data0,
+                      const std::vector<int> &data1, const ShufflePlan &plan, JoinRow *send,
+                      int *keys_recv, double *data0_recv, int *data1_recv)
+{
+    int64_t self_base = plan.recv_disp[rank] - plan.n_send;
+    for (size_t i = 0; i < keys.size(); i++) {
+        int64_t pos = plan.send_pos[i];
+        if (pos < 0)
+            continue;
+        if (pos < plan.n_send) {
+            JoinRow &row = send[pos];
+            row.key = keys[i];
+            row.data1 = data1[i];
+            row.data0 = data0[i];
+        } else {
+            keys_recv[self_base + pos] = keys[i];
+            data0_recv[self_base + pos] = data0[i];
+            data1_recv[self_base + pos] = data1[i];
+        }
+    }
+}
+
+/**
+ * @brief Unpack received rows [begin, end) back into (presized) columns.
+ */
+static void unpack_rows(const JoinRow *rows, int64_t begin, int64_t end,
+                        int *keys, double *data0, int *data1)
+{
+    for (int64_t i = begin; i < end; i++) {
+        keys[i] = rows[i].key;
+        data0[i] = rows[i].data0;
+        data1[i] = rows[i].data1;
+    }
+}
+
+/**
+ * @brief Shuffle the whole right table according to `plan`.
+ * Rows are packed into JoinRow structs so that all columns move in one
+ * MPI_Alltoallv, and unpacked back into columns on the receiving side.
+ *
+ * @param keys Key column of the right table (chunk on this rank)
+ * @param data0 First data column of the right table (chunk on this rank)
+ * @param data1 Second data column of the right table (chunk on this rank)
+ * @param plan Shuffle layout of the right table
+ * @param[out] keys_recv Received key column
+ * @param[out] data0_recv Received first data column
+ * @param[out] data1_recv Received second data column
+ * @param context Buffers to reuse for the packed rows
+ */
+static void shuffle_rows(const std::vector<int> &keys, const std::vector<double> &data0, const std::vector<int> &data1,
+                         ShufflePlan &plan, std::vector<int> &keys_recv, std::vector<double> &data0_recv,
+                         std::vector<int> &data1_recv, JoinContext &context)
+{
+    PhaseTimer timer(PHASE_PACK);
+    std::vector<JoinRow> &send = context.rows_send;
+    std::vector<JoinRow> &recv = context.rows_recv;
+    arena_resize(send, plan.n_send);
+    arena_resize(recv, plan.n_recv);
+    arena_resize(keys_recv, plan.n_recv);
+    arena_resize(data0_recv, plan.n_recv);
+    arena_resize(data1_recv, plan.n_recv);
+    pack_rows(keys, data0, data1, plan, send.data(), keys_recv.data(), data0_recv.data(), data1_recv.data());
+    timer.next(PHASE_ALLTOALLV);
+    shuffle_alltoallv(send.data(), plan.send_counts, plan.send_disp,
+                      recv.data(), plan.recv_counts, plan.recv_disp, join_row_type());
+    JOIN_STAT(record_shuffle_bytes(plan, sizeof(JoinRow)));
+
+    // The self partition is already in place
+    timer.next(PHASE_PACK);
+    int64_t self_begin = plan.recv_disp[rank];
+    unpack_rows(recv.data(), 0, self_begin, keys_recv.data(), data0_recv.data(), data1_recv.data());
+    unpack_rows(recv.data(), self_begin + plan.n_self, plan.n_recv,
+                keys_recv.data(), data0_recv.data(), data1_recv.data());
+}
+
+// SHUFFLE COMPRESSION
+
+// values per bit-packed block, every block stores its own bit width
+static const int PACK_BLOCK = 128;
+
+/**
+ * @brief Append a value to an encoded partition.
+ */
+template <typename T>
+static void put_value(std::vector<char> &out, const T &value)
+{
+    const char *bytes = reinterpret_cast<const char *>(&value);
+    out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+/**
+ * @brief Read a value from an encoded partition and advance `in`.
+ */
+template <typename T>
+static T get_value(const char *&in)
+{
+    T value;
+    std::memcpy(&value, in, sizeof(T));
+    in += sizeof(T);
+    return value;
+}
+
+/**
+ * @brief Bit-pack `n` values in blocks of PACK_BLOCK: every block is one
+ * byte with the bit width of its largest value, then the values in that
+ * many bits each.
+ */
+static void pack_bits(const uint32_t *values, int64_t n, std::vector<char> &out)
+{
+    for (int64_t begin = 0; begin < n; begin += PACK_BLOCK) {
+        int64_t end = std::min(n, begin + PACK_BLOCK);
+        uint32_t max_value = 0;
+        for (int64_t i = begin; i < end; i++)
+            max_value |= values[i];
+        int width = max_value == 0 ? 0 : 32 - __builtin_clz(max_value);
+        out.push_back(char(width));
+
+        uint64_t acc = 0;
+        int fill = 0;
+        for (int64_t i = begin; i < end; i++) {
+            acc |= uint64_t(values[i]) << fill;
+            fill += width;
+            while (fill >= 8) {
+                out.push_back(char(acc & 0xFF));
+                acc >>= 8;
+                fill -= 8;
+            }
+        }
+        if (fill > 0)
+            out.push_back(char(acc & 0xFF));
+    }
+}
+
+/**
+ * @brief Unpack `n` values written by pack_bits and advance `in`.
+ */
+static void unpack_bits(const char *&in, int64_t n, uint32_t *values)
+{
+    for (int64_t begin = 0; begin < n; begin += PACK_BLOCK) {
+        int64_t end = std::min(n, begin + PACK_BLOCK);
+        int width = static_cast<unsigned char>(*in++);
+        uint64_t mask = (uint64_t(1) << width) - 1;
+
+        uint64_t acc = 0;
+        int fill = 0;
+        for (int64_t i = begin; i < end; i++) {
+            while (fill < width) {
+                acc |= uint64_t(static_cast<unsigned char>(*in++)) << fill;
+                fill += 8;
+            }
+            values[i] = uint32_t(acc & mask);
+            acc >>= width;
+            fill -= width;
+        }
+    }
+}
+
+/**
+ * @brief Encode a sorted key column: the first key, then the deltas of
+ * consecutive keys divided by their greatest common divisor, bit-packed.
+ * The divisor only pays off under the modulo partitioner with one partition
+ * per rank, where the keys of a partition differ by multiples of `n_pes`;
+ * for the other partitioners, or when over-partitioning, it is usually 1.
+ */
+static void encode_sorted_keys(const int *keys, int64_t n, std::vector<char> &out)
+{
+    if (n == 0)
+        return;
+    std::vector<uint32_t> deltas(n - 1);
+    uint32_t divisor = 0;
+    for (int64_t i = 1; i < n; i++) {
+        deltas[i - 1] = uint32_t(keys[i]) - uint32_t(keys[i - 1]);
+        for (uint32_t a = deltas[i - 1]; a != 0;) {
+            uint32_t r = divisor % a;
+            divisor = a;
+            a = r;
+        }
+    }
+    if (divisor == 0)
+        divisor = 1;
+    for (int64_t i = 0; i < n - 1; i++)
+        deltas[i] /= divisor;
+    put_value(out, keys[0]);
+    put_value(out, divisor);
+    pack_bits(deltas.data(), n - 1, out);
+}
+
+/**
+ * @brief Decode `n` keys written by encode_sorted_keys and advance `in`.
+ */
+static void decode_sorted_keys(const char *&in, int64_t n, int *keys)
+{
+    if (n == 0)
+        return;
+    keys[0] = get_value<int>(in);
+    uint32_t divisor = get_value<uint32_t>(in);
+    std::vector<uint32_t> deltas(n - 1);
+    unpack_bits(in, n - 1, deltas.data());
+    for (int64_t i = 1; i < n; i++)
+        keys[i] = int(uint32_t(keys[i - 1]) + deltas[i - 1] * divisor);
+}
+
+/**
+ * @brief Encode an int column: the smallest value, then the offsets of all
+ * values from it, bit-packed (frame of reference).
+ */
+static void encode_ints(const int *values, int64_t n, std::vector<char> &out)
+{
+    if (n == 0)
+        return;
+    int min_value = *std::min_element(values, values + n);
+    std::vector<uint32_t> offsets(n);
+    for (int64_t i = 0; i < n; i++)
+        offsets[i] = uint32_t(values[i]) - uint32_t(min_value);
+    put_value(out, min_value);
+    pack_bits(offsets.data(), n, out);
+}
+
+/**
+ * @brief Decode `n` values written by encode_ints and advance `in`.
+ */
+static void decode_ints(const char *&in, int64_t n, int *values)
+{
+    if (n == 0)
+        return;
+    int min_value = get_value<int>(in);
+    std::vector<uint32_t> offsets(n);
+    unpack_bits(in, n, offsets.data());
+    for (int64_t i = 0; i < n; i++)
+        values[i] = int(uint32_t(min_value) + offsets[i]);
+}
+
+/**
+ * @brief Encode a double column: an LZ4 block when built with JOIN_USE_LZ4
+ * and it is smaller, otherwise the raw values. A leading byte tells which.
+ */
+static void encode_doubles(const double *values, int64_t n, std::vector<char> &out)
+{
+    int64_t raw_bytes = n * sizeof(double);
+#ifdef JOIN_USE_LZ4
+    if (raw_bytes > 0 && raw_bytes <= LZ4_MAX_INPUT_SIZE) {
+        std::vector<char> packed(LZ4_compressBound(raw_bytes));
+        int packed_bytes = LZ4_compress_default(reinterpret_cast<const char *>(values), packed.data(),
+                                                raw_bytes, packed.size());
+        if (packed_bytes > 0 && packed_bytes < raw_bytes) {
+            out.push_back(1);
+            put_value<int64_t>(out, packed_bytes);
+            out.insert(out.end(), packed.data(), packed.data() + packed_bytes);
+            return;
+        }
+    }
+#endif
+    out.push_back(0);
+    const char *bytes = reinterpret_cast<const char *>(values);
+    out.insert(out.end(), bytes, bytes + raw_bytes);
+}
+
+/**
+ * @brief Decode `n` values written by encode_doubles and advance `in`.
+ * Runs on join threads, so it does not call MPI itself.
+ *
+ * @return bool False if an LZ4 block does not decode to exactly `n` values
+ */
+static bool decode_doubles(const char *&in, int64_t n, double *values)
+{
+    int64_t raw_bytes = n * sizeof(double);
+    char codec = *in++;
+#ifdef JOIN_USE_LZ4
+    if (codec == 1) {
+        int64_t packed_bytes = get_value<int64_t>(in);
+        int ret = LZ4_decompress_safe(in, reinterpret_cast<char *>(values), packed_bytes, raw_bytes);
+        in += packed_bytes;
+        return ret == raw_bytes;
+    }
+#endif
+    (void)codec;
+    std::memcpy(values, in, raw_bytes);
+    in += raw_bytes;
+    return true;
+}
+
+/**
+ * @brief Encode every partition of a shuffle layout into one send buffer
+ * and exchange the encoded sizes along with the row counts, then move the
+ * bytes with one MPI_Alltoallv and decode every received partition.
+ * The self partition is neither encoded nor sent.
+ *
+ * @param plan Shuffle layout from make_shuffle_plan(..., exchange = false),
+ *  whose receive side is filled in here
+ * @param encode Called as encode(p, out): append destination p's partition to `out`
+ * @param resize Called once the counts are known, to size the receive side
+ * @param decode Called as decode(p, in): decode the partition received from p at `in`
+ * @param context Buffers to reuse for the encoded bytes
+ */
+template <typename Encode, typename Resize, typename Decode>
+static void shuffle_encoded(ShufflePlan &plan, Encode encode, Resize resize, Decode decode, JoinContext &context)
+{
+    std::vector<std::vector<char> > parts(n_pes);
+    {
+        PhaseTimer timer(PHASE_PACK);
+        for_each_morsel(join_config.threads, n_pes, [&](int64_t p) {
+            if (p != rank)
+                encode(p, parts[p]);
+        });
+    }
+
+    std::vector<int64_t> send_bytes(n_pes), send_byte_disp(n_pes, 0);
+    std::vector<int64_t> recv_bytes, recv_byte_disp(n_pes, 0);
+    for (int p = 0; p < n_pes; p++)
+        send_bytes[p] = parts[p].size();
+    exchange_shuffle_counts(plan, &send_bytes, &recv_bytes);
+    PhaseTimer timer(PHASE_PACK);
+    for (int p = 1; p < n_pes; p++) {
+        send_byte_disp[p] = send_byte_disp[p - 1] + send_bytes[p - 1];
+        recv_byte_disp[p] = recv_byte_disp[p - 1] + recv_bytes[p - 1];
+    }
+
+    std::vector<char> &send = context.bytes_send;
+    std::vector<char> &recv = context.bytes_recv;
+    arena_resize(send, send_byte_disp[n_pes - 1] + send_bytes[n_pes - 1]);
+    arena_resize(recv, recv_byte_disp[n_pes - 1] + recv_bytes[n_pes - 1]);
+    for (int p = 0; p < n_pes; p++)
+        std::copy(parts[p].begin(), parts[p].end(), send.begin() + send_byte_disp[p]);
+    std::vector<std::vector<char> >().swap(parts);
+    timer.next(PHASE_ALLTOALLV);
+    shuffle_alltoallv(send.data(), send_bytes, send_byte_disp, recv.data(), recv_bytes, recv_byte_disp, MPI_BYTE);
+    JOIN_STAT(join_stats.bytes_sent += send.size(); join_stats.bytes_recv += recv.size());
+
+    timer.next(PHASE_PACK);
+    resize();
+    for_each_morsel(join_config.threads, n_pes, [&](int64_t p) {
+        if (p != rank && plan.recv_counts[p] > 0)
+            decode(p, recv.data() + recv_byte_disp[p]);
+    });
+}
+
+/**
+ * @brief Same as shuffle_column, except that every partition is sorted and
+ * sent as bit-packed key deltas (see encode_sorted_keys). Row order within
+ * a partition is not kept, which the left keys of the join do not need.
+ *
+ * @param col Column to shuffle (chunk on this rank)
+ * @param plan Shuffle layout from make_shuffle_plan(..., exchange = false)
+ * @param[out] recv Rows of the column received by this rank
+ * @param context Buffers to reuse
+ */
+static void shuffle_column_compressed(const std::vector<int> &col, ShufflePlan &plan, std::vector<int> &recv,
+                                      JoinContext &context)
+{
+    // Rows grouped by destination, the self partition last
+    std::vector<int> &grouped = context.keys_send;
+    arena_resize(grouped, plan.n_send + plan.n_self);
+    for (size_t i = 0; i < col.size(); i++) {
+        if (plan.send_pos[i] >= 0)
+            grouped[plan.send_pos[i]] = col[i];
+    }
+
+    shuffle_encoded(plan,
+        [&](int p, std::vector<char> &out) {
+            int *part = grouped.data() + plan.send_disp[p];
+            std::sort(part, part + plan.send_counts[p]);
+            encode_sorted_keys(part, plan.send_counts[p], out);
+        },
+        [&]() { arena_resize(recv, plan.n_recv); },
+        [&](int p, const char *in) {
+            decode_sorted_keys(in, plan.recv_counts[p], recv.data() + plan.recv_disp[p]);
+        },
+        context);
+    std::copy(grouped.begin() + plan.n_send, grouped.end(), recv.begin() + plan.recv_disp[rank]);
+}
+
+/**
+ * @brief Same as shuffle_rows, except that every partition is sorted by key
+ * and sent compressed: bit-packed key deltas, frame of reference bit-packed
+ * data1, and data0 as raw or LZ4 compressed doubles (see encode_doubles).
+ *
+ * @param keys Key column of the right table (chunk on this rank)
+ * @param data0 First data column of the right table (chunk on this rank)
+ * @param data1 Second data column of the right table (chunk on this rank)
+ * @param plan Shuffle layout from make_shuffle_plan(..., exchange = false)
+ * @param[out] keys_recv Received key column
+ * @param[out] data0_recv Received first data column
+ * @param[out] data1_recv Received second data column
+ * @param context Buffers to reuse
+ */
+static void shuffle_rows_compressed(const std::vector<int> &keys, const std::vector<double> &data0,
+                                    const std::vector<int> &data1, ShufflePlan &plan,
+                                    std::vector<int> &keys_recv, std::vector<double> &data0_recv,
+                                    std::vector<int> &data1_recv, JoinContext &context)
+{
+    // Rows grouped by destination, the self partition last
+    std::vector<JoinRow> &grouped = context.rows_send;
+    arena_resize(grouped, plan.n_send + plan.n_self);
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (plan.send_pos[i] >= 0) {
+            JoinRow &row = grouped[plan.send_pos[i]];
+            row.key = keys[i];
+            row.data1 = data1[i];
+            row.data0 = data0[i];
+        }
+    }
+
+    // Set by the decoding threads; the job is aborted from this thread
+    std::atomic<bool> corrupt(false);
+    shuffle_encoded(plan,
+        [&](int p, std::vector<char> &out) {
+            int64_t n = plan.send_counts[p];
+            JoinRow *part = grouped.data() + plan.send_disp[p];
+            std::sort(part, part + n, [](const JoinRow &a, const JoinRow &b) { return a.key < b.key; });
+            std::vector<int> ints(n);
+            std::vector<double> doubles(n);
+            for (int64_t i = 0; i < n; i++)
+                ints[i] = part[i].key;
+            encode_sorted_keys(ints.data(), n, out);
+            for (int64_t i = 0; i < n; i++) {
+                ints[i] = part[i].data1;
+                doubles[i] = part[i].data0;
+            }
+            encode_ints(ints.data(), n, out);
+            encode_doubles(doubles.data(), n, out);
+        },
+        [&]() {
+            arena_resize(keys_recv, plan.n_recv);
+            arena_resize(data0_recv, plan.n_recv);
+            arena_resize(data1_recv, plan.n_recv);
+        },
+        [&](int p, const char *in) {
+            int64_t n = plan.recv_counts[p];
+            int64_t disp = plan.recv_disp[p];
+            decode_sorted_keys(in, n, keys_recv.data() + disp);
+            decode_ints(in, n, data1_recv.data() + disp);
+            if (!decode_doubles(in, n, data0_recv.data() + disp))
+                corrupt = true;
+        },
+        context);
+    if (corrupt) {
+        std::cerr << "Rank " << rank << ": corrupt LZ4 block in the compressed shuffle" << std::endl;
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (int64_t j = 0; j < plan.n_self; j++) {
+        const JoinRow &row = grouped[plan.n_send + j];
+        keys_recv[plan.recv_disp[rank] + j] = row.key;
+        data0_recv[plan.recv_disp[rank] + j] = row.data0;
+        data1_recv[plan.recv_disp[rank] + j] = row.data1;
+    }
+}
+
+// SEMI-JOIN PRE-FILTER
+
+/**
+ * @brief Blocked Bloom filter over int32 keys.
+ * Every key sets BLOOM_K bits inside a single 512-bit (cache line) block,
+ * so a lookup touches only one cache line.
+ */
+struct BloomFilter {
+    static const int WORDS_PER_BLOCK = 8;
+    static const int BLOOM_K = 4;
+
+    std::vector<uint64_t> words;
+    int block_bits; // log2 of the number of blocks
+
+    /**
+     * @brief Size an empty filter for `n_keys` keys.
+     */
+    void init(int64_t n_keys, int bits_per_key)
+    {
+        int64_t n_blocks = (n_keys * bits_per_key + 511) / 512;
+        block_bits = 0;
+        while ((int64_t(1) << block_bits) < n_blocks)
+            block_bits++;
+        words.assign(WORDS_PER_BLOCK << block_bits, 0);
+    }
+
+    /**
+     * @brief 64-bit hash of a key (murmur3 64-bit finalizer). The top bits
+     * select the block and the low 36 bits the BLOOM_K bits in the block.
+     */
+    static inline uint64_t hash(int key)
+    {
+        uint64_t h = static_cast<uint32_t>(key);
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    inline uint64_t *block(uint64_t h)
+    {
+        return &words[block_bits == 0 ? 0 : (h >> (64 - block_bits)) * WORDS_PER_BLOCK];
+    }
+
+    inline const uint64_t *block(uint64_t h) const
+    {
+        return &words[block_bits == 0 ? 0 : (h >> (64 - block_bits)) * WORDS_PER_BLOCK];
+    }
+
+    void insert(int key)
+    {
+        uint64_t h = hash(key);
+        uint64_t *b = block(h);
+        for (int j = 0; j < BLOOM_K; j++) {
+            uint64_t bit = (h >> (9 * j)) & 511;
+            b[bit >> 6] |= uint64_t(1) << (bit & 63);
+        }
+    }
+
+    bool may_contain(int key) const
+    {
+        uint64_t h = hash(key);
+        const uint64_t *b = block(h);
+        for (int j = 0; j < BLOOM_K; j++) {
+            uint64_t bit = (h >> (9 * j)) & 511;
+            if ((b[bit >> 6] & (uint64_t(1) << (bit & 63))) == 0)
+                return false;
+        }
+        return true;
+    }
+};
+
+/**
+ * @brief Semi-join pre-filter of the left table.
+ * Every rank builds a Bloom filter of the same size over its local right
+ * keys, the filters are combined with a bitwise OR MPI_Allreduce, and left
+ * rows whose key is definitely not in the right table are dropped, so they
+ * are never shuffled.
+ *
+ * @param keys1 Key column of the left table (chunk on this rank)
+ * @param keys2 Key column of the right table (chunk on this rank)
+ * @param[out] rejected Left keys that cannot match, for the join types that
+ *  output unmatched rows (optional)
+ * @return std::vector<int> Left keys that may have a match
+ */
+static std::vector<int> bloom_filter_keys(const std::vector<int> &keys1, const std::vector<int> &keys2,
+                                          std::vector<int> *rejected = NULL)
+{
+    BloomFilter filter;
+    filter.init(allreduce_sum_scalar((int64_t)keys2.size()), join_config.bloom_bits_per_key);
+    for (size_t i = 0; i < keys2.size(); i++)
+        filter.insert(keys2[i]);
+    allreduce_bor_uint64(filter.words.data(), filter.words.size());
+
+    std::vector<int> filtered;
+    filtered.reserve(keys1.size());
+    for (size_t i = 0; i < keys1.size(); i++) {
+        if (filter.may_contain(keys1[i]))
+            filtered.push_back(keys1[i]);
+        else if (rejected != NULL)
+            rejected->push_back(keys1[i]);
+    }
+    return filtered;
+}
+
+// SKEW HANDLING
+
+// most frequent sampled keys every rank proposes as heavy hitter candidates
+static const int SKEW_CANDIDATES_PER_RANK = 16;
+
+/**
+ * @brief Find the heavy hitter keys of the left table.
+ * Every rank proposes the most frequent keys of a strided sample of its
+ * rows, the candidates of all ranks are exchanged with MPI_Allgather, and
+ * their exact global frequencies are computed with MPI_Allreduce. A key is
+ * a heavy hitter if it alone has more than `join_config.skew_threshold`
+ * times the average number of left rows per rank.
+ *
+ * @param keys Key column of the left table (chunk on this rank)
+ * @return std::vector<int> Heavy hitter keys (the same on every rank)
+ */
+static std::vector<int> find_heavy_hitters(const std::vector<int> &keys)
+{
+    int64_t n = keys.size();
+    int64_t n_global = allreduce_sum_scalar(n);
+
+    // Local candidates: the most frequent keys of the sample (padded with
+    // repeats, which are dropped below)
+    int64_t n_sample = std::min(n, join_config.skew_sample_rows);
+    std::vector<int> sample(n_sample);
+    for (int64_t i = 0; i < n_sample; i++)
+        sample[i] = keys[i * n / n_sample];
+    std::sort(sample.begin(), sample.end());
+    std::vector<std::pair<int64_t, int>> freq;
+    for (int64_t i = 0, j = 0; i < n_sample; i = j) {
+        while (j < n_sample && sample[j] == sample[i])
+            j++;
+        freq.push_back(std::make_pair(j - i, sample[i]));
+    }
+    int n_freq = std::min<int64_t>(freq.size(), SKEW_CANDIDATES_PER_RANK);
+    std::partial_sort(freq.begin(), freq.begin() + n_freq, freq.end(),
+                      std::greater<std::pair<int64_t, int>>());
+    std::vector<int> local_candidates(SKEW_CANDIDATES_PER_RANK, n_freq > 0 ? freq[0].second : 0);
+    for (int c = 0; c < n_freq; c++)
+        local_candidates[c] = freq[c].second;
+
+    std::vector<int> candidates(SKEW_CANDIDATES_PER_RANK * n_pes);
+    allgather_int(local_candidates.data(), SKEW_CANDIDATES_PER_RANK, candidates.data());
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+    // Exact global frequency of every candidate; candidates are distinct,
+    // so each slot's run holds just the candidate's index
+    JoinHashTable candidate_table;
+    candidate_table.build(candidates.data(), candidates.size());
+    std::vector<int64_t> local_counts(candidates.size(), 0);
+    std::vector<int64_t> global_counts(candidates.size(), 0);
+    for (int64_t i = 0; i < n; i++) {
+        const JoinHashTable::Slot *slot = candidate_table.find(keys[i]);
+        if (slot != NULL)
+            local_counts[candidate_table.rows[slot->start]]++;
+    }
+    allreduce_sum_int64(local_counts.data(), global_counts.data(), candidates.size());
+
+    std::vector<int> heavy_hitters;
+    double threshold = join_config.skew_threshold * n_global / n_pes;
+    for (size_t c = 0; c < candidates.size(); c++) {
+        if (global_counts[c] > threshold)
+            heavy_hitters.push_back(candidates[c]);
+    }
+    return heavy_hitters;
+}
+
+/**
+ * @brief Append the rows this rank kept out of the shuffle (send_pos < 0)
+ * to the received key column of the left table.
+ */
+static void append_skipped_keys(const std::vector<int> &keys, const ShufflePlan &plan,
+                                std::vector<int> &keys_recv)
+{
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (plan.send_pos[i] < 0)
+            keys_recv.push_back(keys[i]);
+    }
+}
+
+/**
+ * @brief Replicate right table rows on every rank with MPI_Allgatherv, and
+ * append the rows of all ranks to the received columns.
+ *
+ * @param send This rank's rows
+ * @param[out] keys_recv Received key column
+ * @param[out] data0_recv Received first data column
+ * @param[out] data1_recv Received second data column
+ */
+static void allgather_rows(std::vector<JoinRow> &send, std::vector<int> &keys_recv,
+                           std::vector<double> &data0_recv, std::vector<int> &data1_recv)
+{
+    std::vector<int64_t> recv_counts, recv_disp;
+    int64_t n_recv = allgather_layout(send.size(), recv_counts, recv_disp);
+    std::vector<JoinRow> recv(n_recv);
+    allgatherv_row(send.data(), int64_t(send.size()), recv.data(), recv_counts, recv_disp);
+
+    for (int64_t i = 0; i < n_recv; i++) {
+        keys_recv.push_back(recv[i].key);
+        data0_recv.push_back(recv[i].data0);
+        data1_recv.push_back(recv[i].data1);
+    }
+}
+
+/**
+ * @brief Replicate the right table rows kept out of the shuffle (send_pos < 0)
+ * on every rank, and append them to the received columns.
+ */
+static void broadcast_skipped_rows(const std::vector<int> &keys, const std::vector<double> &data0,
+                                   const std::vector<int> &data1, const ShufflePlan &plan,
+                                   std::vector<int> &keys_recv, std::vector<double> &data0_recv,
+                                   std::vector<int> &data1_recv)
+{
+    std::vector<JoinRow> send;
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (plan.send_pos[i] < 0) {
+            JoinRow row = {keys[i], data1[i], data0[i]};
+            send.push_back(row);
+        }
+    }
+    allgather_rows(send, keys_recv, data0_recv, data1_recv);
+}
+
+/**
+ * @brief Same as broadcast_skipped_rows for the right keys only, for the
+ * join types that need no right payload.
+ */
+static void broadcast_skipped_keys(const std::vector<int> &keys, const ShufflePlan &plan,
+                                   std::vector<int> &keys_recv)
+{
+    std::vector<int> send;
+    append_skipped_keys(keys, plan, send);
+    std::vector<int64_t> recv_counts, recv_disp;
+    size_t base = keys_recv.size();
+    keys_recv.resize(base + allgather_layout(send.size(), recv_counts, recv_disp));
+    allgatherv_int(send.data(), int64_t(send.size()), keys_recv.data() + base, recv_counts, recv_disp);
+}
+
+// BROADCAST JOIN
+
+/**
+ * @brief Broadcast join: if one side is small enough, replicate it on every
+ * rank with MPI_Allgatherv and join it with the other side's local chunk,
+ * which does not move at all. Every match is still produced exactly once,
+ * on the rank that holds the non-replicated row.
+ * The side with fewer bytes (4 per left row, sizeof(JoinRow) per right row,
+ * or 4 when the join type needs no right payload) is replicated if its global
+ * size is at most `join_config.broadcast_max_bytes`. Only inner and count
+ * joins may replicate the left side: the other types look at every left row
+ * once, so unmatched or semi joined rows would be output on every rank.
+ *
+ * @param[out] keys_out Output key column, if a broadcast join was done
+ * @param[out] data0_out Output first data column, if a broadcast join was done
+ * @param[out] data1_out Output second data column, if a broadcast join was done
+ * @param context Buffers to reuse for the local join
+ * @param type Join type (see local_join_into)
+ * @param[out] result Result of the local join (see local_join_into)
+ * @return bool Whether a broadcast join was done (the same on every rank)
+ */
+static bool broadcast_join(const std::vector<int> &keys1, const std::vector<int> &keys2,
+                           const std::vector<double> &data0, const std::vector<int> &data1,
+                           std::vector<int> &keys_out, std::vector<double> &data0_out,
+                           std::vector<int> &data1_out, JoinContext &context, JoinType type, int64_t &result)
+{
+    int64_t local_rows[2] = {(int64_t)keys1.size(), (int64_t)keys2.size()};
+    int64_t global_rows[2];
+    allreduce_sum_int64(local_rows, global_rows, 2);
+    bool payload = join_has_payload(type);
+    bool replicate_left = type == JOIN_INNER || type == JOIN_COUNT;
+    int64_t left_bytes = replicate_left ? global_rows[0] * int64_t(sizeof(int)) : std::numeric_limits<int64_t>::max();
+    int64_t right_bytes = global_rows[1] * int64_t(payload ? sizeof(JoinRow) : sizeof(int));
+
+    if (std::min(left_bytes, right_bytes) > join_config.broadcast_max_bytes)
+        return false;
+
+    if (right_bytes <= left_bytes && !payload) {
+        std::vector<int64_t> recv_counts, recv_disp;
+        std::vector<int> keys2_all(allgather_layout(keys2.size(), recv_counts, recv_disp));
+        allgatherv_int(keys2.data(), int64_t(keys2.size()), keys2_all.data(), recv_counts, recv_disp);
+        result = local_join_into(keys1, keys2_all, data0, data1, keys_out, data0_out, data1_out, &context, type);
+    } else if (right_bytes <= left_bytes) {
+        std::vector<JoinRow> rows(keys2.size());
+        for (size_t i = 0; i < keys2.size(); i++) {
+            rows[i].key = keys2[i];
+            rows[i].data1 = data1[i];
+            rows[i].data0 = data0[i];
+        }
+        std::vector<int> keys2_all;
+        std::vector<double> data0_all;
+        std::vector<int> data1_all;
+        allgather_rows(rows, keys2_all, data0_all, data1_all);
+        result = local_join_into(keys1, keys2_all, data0_all, data1_all, keys_out, data0_out, data1_out, &context,
+                                 type);
+    } else {
+        std::vector<int64_t> recv_counts, recv_disp;
+        std::vector<int> keys1_all(allgather_layout(keys1.size(), recv_counts, recv_disp));
+        allgatherv_int(keys1.data(), int64_t(keys1.size()), keys1_all.data(), recv_counts, recv_disp);
+        result = local_join_into(keys1_all, keys2, data0, data1, keys_out, data0_out, data1_out, &context, type);
+    }
+    return true;
+}
+
+// message tags of the pipelined shuffle
+static const int TAG_RIGHT_ROWS = 1;
+static const int TAG_LEFT_KEYS = 2;
+
+/**
+ * @brief Post the non-blocking send or receive of one partition, split into
+ * messages of at most LARGE_COUNT_CHUNK elements so counts never overflow an int.
+ *
+ * @param is_send Whether to post sends (MPI_Isend) or receives (MPI_Irecv)
+ * @param buffer First element of the partition
+ * @param count Number of elements in the partition
+ * @param type MPI datatype of the elements
+ * @param peer Rank to send to or receive from
+ * @param tag Message tag
+ * @param[in,out] reqs Posted requests
+ * @param[in,out] req_peer Peer of every posted request
+ */
+template <typename T>
+static void post_partition(bool is_send, T *buffer, int64_t count, MPI_Datatype type, int peer, int tag,
+                           std::vector<MPI_Request> &reqs, std::vector<int> &req_peer)
+{
+    for (int64_t off = 0; off < count; off += LARGE_COUNT_CHUNK) {
+        int n = std::min(LARGE_COUNT_CHUNK, count - off);
+        reqs.push_back(MPI_REQUEST_NULL);
+        req_peer.push_back(peer);
+        if (is_send)
+            MPI_Isend(buffer + off, n, type, peer, tag, MPI_COMM_WORLD, &reqs.back());
+        else
+            MPI_Irecv(buffer + off, n, type, peer, tag, MPI_COMM_WORLD, &reqs.back());
+    }
+}
+
+/**
+ * @brief Wait until every message of some partition has arrived.
+ *
+ * @param reqs Posted receives
+ * @param req_peer Peer of every posted receive
+ * @param[in,out] pending Number of outstanding messages from every peer
+ * @return int Rank whose partition is complete, or -1 once all partitions are
+ */
+static int wait_partition(std::vector<MPI_Request> &reqs, const std::vector<int> &req_peer,
+                          std::vector<int> &pending)
+{
+    while (true) {
+        int idx;
+        MPI_Waitany(reqs.size(), reqs.data(), &idx, MPI_STATUS_IGNORE);
+        if (idx == MPI_UNDEFINED)
+            return -1;
+        if (--pending[req_peer[idx]] == 0)
+            return req_peer[idx];
+    }
+}
+
+/**
+ * @brief Pipelined variant of parallel_join_impl.
+ * Partitions are exchanged with non-blocking point-to-point messages instead
+ * of MPI_Alltoallv. Right table partitions are inserted into the hash table
+ * as soon as they arrive, and once the table is complete each left table
+ * partition is probed as soon as it lands, so communication overlaps with
+ * the build and the probe.
+ */
+static void parallel_join_async(const std::vector<int> &keys1, const std::vector<int> &keys2,
+                                const std::vector<double> &data0, const std::vector<int> &data1,
+                                std::vector<int> &keys_out, std::vector<double> &data0_out,
+                                std::vector<int> &data1_out, JoinContext &context)
+{
+    ShufflePlan &right_plan = context.right_plan;
+    make_shuffle_plan(keys2, context.partitions, right_plan);
+    ShufflePlan &left_plan = context.left_plan;
+    make_shuffle_plan(keys1, context.partitions, left_plan);
+
+    PhaseTimer timer(PHASE_PACK);
+    std::vector<JoinRow> &rows_send = context.rows_send;
+    std::vector<JoinRow> &rows_recv = context.rows_recv;
+    std::vector<int> &keys2_recv = context.keys2_recv;
+    std::vector<double> &data0_recv = context.data0_recv;
+    std::vector<int> &data1_recv = context.data1_recv;
+    arena_resize(rows_send, right_plan.n_send);
+    arena_resize(rows_recv, right_plan.n_recv);
+    arena_resize(keys2_recv, right_plan.n_recv);
+    arena_resize(data0_recv, right_plan.n_recv);
+    arena_resize(data1_recv, right_plan.n_recv);
+    pack_rows(keys2, data0, data1, right_plan, rows_send.data(),
+              keys2_recv.data(), data0_recv.data(), data1_recv.data());
+
+    std::vector<int> &keys1_send = context.keys_send;
+    std::vector<int> &keys1_recv = context.keys1_recv;
+    arena_resize(keys1_send, left_plan.n_send);
+    arena_resize(keys1_recv, left_plan.n_recv);
+    scatter_column(keys1, left_plan, keys1_send.data(), keys1_recv.data());
+
+    // Post all receives before any send, then send the build side first.
+    // Destinations are visited starting from this rank to spread the load.
+    timer.next(PHASE_ALLTOALLV);
+    std::vector<MPI_Request> right_reqs, left_reqs, send_reqs;
+    std::vector<int> right_peer, left_peer, send_peer;
+    std::vector<int> right_pending(n_pes), left_pending(n_pes);
+    for (int p = 0; p < n_pes; p++) {
+        post_partition(false, rows_recv.data() + right_plan.recv_disp[p], right_plan.recv_counts[p],
+                       join_row_type(), p, TAG_RIGHT_ROWS, right_reqs, right_peer);
+        post_partition(false, keys1_recv.data() + left_plan.recv_disp[p], left_plan.recv_counts[p],
+                       MPI_INT, p, TAG_LEFT_KEYS, left_reqs, left_peer);
+    }
+    for (size_t r = 0; r < right_peer.size(); r++)
+        right_pending[right_peer[r]]++;
+    for (size_t r = 0; r < left_peer.size(); r++)
+        left_pending[left_peer[r]]++;
+    for (int i = 0; i < n_pes; i++) {
+        int p = (rank + i) % n_pes;
+        post_partition(true, rows_send.data() + right_plan.send_disp[p], right_plan.send_counts[p],
+                       join_row_type(), p, TAG_RIGHT_ROWS, send_reqs, send_peer);
+    }
+    for (int i = 0; i < n_pes; i++) {
+        int p = (rank + i) % n_pes;
+        post_partition(true, keys1_send.data() + left_plan.send_disp[p], left_plan.send_counts[p],
+                       MPI_INT, p, TAG_LEFT_KEYS, send_reqs, send_peer);
+    }
+
+    // Build: insert the self partition, then every other partition as it arrives.
+    // Waiting for a partition counts as Alltoallv time.
+    timer.next(PHASE_BUILD);
+    JoinHashTable &table = context.table;
+    table.init(right_plan.n_recv);
+    table.insert(keys2_recv.data(), right_plan.recv_disp[rank], right_plan.recv_disp[rank] + right_plan.n_self);
+    int p;
+    for (;;) {
+        timer.next(PHASE_ALLTOALLV);
+        if ((p = wait_partition(right_reqs, right_peer, right_pending)) < 0)
+            break;
+        int64_t begin = right_plan.recv_disp[p];
+        int64_t end = begin + right_plan.recv_counts[p];
+        timer.next(PHASE_PACK);
+        unpack_rows(rows_recv.data(), begin, end, keys2_recv.data(), data0_recv.data(), data1_recv.data());
+        timer.next(PHASE_BUILD);
+        table.insert(keys2_recv.data(), begin, end);
+    }
+    timer.next(PHASE_BUILD);
+    table.finalize();
+    JOIN_STAT(record_table(table));
+
+    // Probe: join the self partition, then every other partition as it arrives
+    timer.stop();
+    keys_out.clear();
+    data0_out.clear();
+    data1_out.clear();
+    probe_append(table, keys1_recv.data() + left_plan.recv_disp[rank], left_plan.n_self,
+                 data0_recv.data(), data1_recv.data(), keys_out, data0_out, data1_out,
+                 join_config.threads);
+    for (;;) {
+        timer.next(PHASE_ALLTOALLV);
+        if ((p = wait_partition(left_reqs, left_peer, left_pending)) < 0)
+            break;
+        timer.stop();
+        probe_append(table, keys1_recv.data() + left_plan.recv_disp[p], left_plan.recv_counts[p],
+                     data0_recv.data(), data1_recv.data(), keys_out, data0_out, data1_out,
+                     join_config.threads);
+    }
+
+    MPI_Waitall(send_reqs.size(), send_reqs.data(), MPI_STATUSES_IGNORE);
+    JOIN_STAT(record_shuffle_bytes(right_plan, sizeof(JoinRow)); record_shuffle_bytes(left_plan, sizeof(int));
+              join_stats.probe_rows += left_plan.n_recv; join_stats.output_rows += keys_out.size());
+}
+
+/**
+ * @brief Distributed join implementation for joining two tables
+ * on an integer column.
+ * Both tables are hash partitioned by key (see PartitionMap) and shuffled
+ * with MPI_Alltoallv (one collective per table), so all rows with the
+ * same key end up on the same rank, which then performs a local join.
+ * With `join_config.async_shuffle` set, the pipelined parallel_join_async
+ * is used instead.
+ * With `join_config.skew_handling` set, the left rows of heavy hitter keys
+ * stay on their rank and the right rows of those keys are replicated on
+ * every rank, so no single rank receives all rows of a hot key (this always
+ * uses the collective shuffle).
+ * If either side is globally small, it is replicated instead and no
+ * shuffle is done (see broadcast_join).
+ * With `join_config.bloom_filter` set, left rows that cannot match are
+ * dropped before the shuffle (see bloom_filter_keys).
+ * With `join_config.compress_shuffle` set, the partitions are sent
+ * compressed (see shuffle_rows_compressed), which uses the collective shuffle.
+ * Shuffle buffers, layouts and the hash table come from `context`, so
+ * repeated joins with the same context reuse their memory (see JoinContext).
+ * The output overwrites the caller's columns in place, as in local_join_into.
+ * Join types other than inner (see JoinType) always use the collective
+ * shuffle, and the semi, anti and count joins only shuffle the right keys.
+ *
+ * @param keys1 Join key column in the first table (chunk on this rank)
+ * @param keys2 Join key column in the second table (chunk on this rank)
+ * @param data0 First data column in the second table (chunk on this rank)
+ * @param data1 Second data data column in the second table (chunk on this rank)
+ * @param[out] keys_out Output key column (distributed output on this rank)
+ * @param[out] data0_out Output first data column
+ * @param[out] data1_out Output second data column
+ * @param context Buffers to reuse (default_join_context if NULL)
+ * @param type Join type (see local_join_into)
+ * @return int64_t Number of output rows on this rank, or for JOIN_COUNT the
+ *  number of matching row pairs found on this rank
+ */
+int64_t parallel_join_into(const std::vector<int> &keys1, const std::vector<int> &keys2,
+                           const std::vector<double> &data0, const std::vector<int> &data1,
+                           std::vector<int> &keys_out, std::vector<double> &data0_out,
+                           std::vector<int> &data1_out, JoinContext *context = NULL, JoinType type = JOIN_INNER)
+{
+    JoinContext &ctx = context ? *context : default_join_context;
+    int64_t result = 0;
+    if (n_pes > 1 && join_config.broadcast_max_bytes > 0 &&
+        broadcast_join(keys1, keys2, data0, data1, keys_out, data0_out, data1_out, ctx, type, result))
+        return result;
+
+    bool bloom_filter = join_config.bloom_filter && n_pes > 1;
+    std::vector<int> keys1_filtered;
+    std::vector<int> keys1_rejected;
+    if (bloom_filter)
+        keys1_filtered = bloom_filter_keys(keys1, keys2, join_needs_unmatched(type) ? &keys1_rejected : NULL);
+    const std::vector<int> &left_keys = bloom_filter ? keys1_filtered : keys1;
+
+    bool skew_handling = join_config.skew_handling && n_pes > 1;
+    bool compress = join_config.compress_shuffle && n_pes > 1;
+    bool hierarchical = join_config.hierarchical_shuffle && n_pes > 1;
+    assign_partitions(left_keys, keys2, ctx.partitions);
+    if (join_config.async_shuffle && !skew_handling && !compress && !hierarchical && type == JOIN_INNER) {
+        parallel_join_async(left_keys, keys2, data0, data1, keys_out, data0_out, data1_out, ctx);
+        return keys_out.size();
+    }
+
+    JoinHashTable heavy_table;
+    const JoinHashTable *heavy = NULL;
+    if (skew_handling) {
+        std::vector<int> heavy_hitters = find_heavy_hitters(left_keys);
+        heavy_table.build(heavy_hitters.data(), heavy_hitters.size());
+        if (!heavy_hitters.empty())
+            heavy = &heavy_table;
+    }
+
+    ShufflePlan &left_plan = ctx.left_plan;
+    make_shuffle_plan(left_keys, ctx.partitions, left_plan, heavy, !compress);
+    std::vector<int> &keys1_recv = ctx.keys1_recv;
+    if (compress)
+        shuffle_column_compressed(left_keys, left_plan, keys1_recv, ctx);
+    else
+        shuffle_column(left_keys, left_plan, keys1_recv, ctx);
+
+    ShufflePlan &right_plan = ctx.right_plan;
+    make_shuffle_plan(keys2, ctx.partitions, right_plan, heavy, !compress);
+    std::vector<int> &keys2_recv = ctx.keys2_recv;
+    std::vector<double> &data0_recv = ctx.data0_recv;
+    std::vector<int> &data1_recv = ctx.data1_recv;
+    bool payload = join_has_payload(type);
+    if (!payload) {
+        data0_recv.clear();
+        data1_recv.clear();
+    }
+    if (!payload && compress)
+        shuffle_column_compressed(keys2, right_plan, keys2_recv, ctx);
+    else if (!payload)
+        shuffle_column(keys2, right_plan, keys2_recv, ctx);
+    else if (compress)
+        shuffle_rows_compressed(keys2, data0, data1, right_plan, keys2_recv, data0_recv, data1_recv, ctx);
+    else
+        shuffle_rows(keys2, data0, data1, right_plan, keys2_recv, data0_recv, data1_recv, ctx);
+
+    if (heavy != NULL) {
+        append_skipped_keys(left_keys, left_plan, keys1_recv);
+        if (payload)
+            broadcast_skipped_rows(keys2, data0, data1, right_plan, keys2_recv, data0_recv, data1_recv);
+        else
+            broadcast_skipped_keys(keys2, right_plan, keys2_recv);
+    }
+
+    result = local_join_into(keys1_recv, keys2_recv, data0_recv, data1_recv, keys_out, data0_out, data1_out, &ctx,
+                             type);
+
+    // Left rows the Bloom filter dropped have no match
+    for (size_t i = 0; i < keys1_rejected.size(); i++) {
+        keys_out.push_back(keys1_rejected[i]);
+        if (type == JOIN_LEFT_OUTER) {
+            data0_out.push_back(JOIN_NULL_DOUBLE);
+            data1_out.push_back(JOIN_NULL_INT);
+        }
+    }
+    return type == JOIN_COUNT ? result : int64_t(keys_out.size());
+}
+
+/**
+ * @brief Same as parallel_join_into, with the output returned in new
+ * columns, which are moved (never copied) as in local_join_impl.
+ *
+ * @param keys1 Join key column in the first table (chunk on this rank)
+ * @param keys2 Join key column in the second table (chunk on this rank)
+ * @param data0 First data column in the second table (chunk on this rank)
+ * @param data1 Second data data column in the second table (chunk on this rank)
+ * @param context Buffers to reuse (default_join_context if NULL)
+ * @param type Join type (see local_join_into)
+ * @return std::tuple<std::vector<int>, std::vector<double>, std::vector<int>>
+ *  Resulting distributed output (key and data columns from the right table)
+ */
+std::tuple<std::vector<int>, std::vector<double>, std::vector<int>> parallel_join_impl(
+    const std::vector<int> &keys1, const std::vector<int> &keys2, const std::vector<double> &data0,
+    const std::vector<int> &data1, JoinContext *context = NULL, JoinType type = JOIN_INNER)
+{
+    std::vector<int> keys_result;
+    std::vector<double> data0_result;
+    std::vector<int> data1_result;
+    parallel_join_into(keys1, keys2, data0, data1, keys_result, data0_result, data1_result, context, type);
+    return std::make_tuple(std::move(keys_result), std::move(data0_result), std::move(data1_result));
+}
+
+/**
+ * @brief Number of matching row pairs of the distributed inner join of two
+ * key columns, without materializing any output row (JOIN_COUNT).
+ *
+ * @param keys1 Join key column in the first table (chunk on this rank)
+ * @param keys2 Join key column in the second table (chunk on this rank)
+ * @param context Buffers to reuse (default_join_context if NULL)
+ * @return int64_t Global number of output rows of the inner join (on every rank)
+ */
+int64_t parallel_join_count(const std::vector<int> &keys1, const std::vector<int> &keys2,
+                            JoinContext *context = NULL)
+{
+    std::vector<double> no_data0;
+    std::vector<int> no_data1;
+    std::vector<int> keys_out;
+    std::vector<double> data0_out;
+    std::vector<int> data1_out;
+    int64_t count = parallel_join_into(keys1, keys2, no_data0, no_data1, keys_out, data0_out, data1_out, context,
+                                       JOIN_COUNT);
+    return allreduce_sum_scalar(count);
+}
+
+// JOIN AGGREGATION
+
+/**
+ * @brief Aggregates of the joined rows of one key: their number, and the
+ * sum, min and max of both right table data columns over them. The same
+ * struct holds the partial aggregate of some right rows of a key before they
+ * are joined, which is what the build side pre-aggregation shuffles.
+ */
+struct JoinAggregate {
+    int key;
+    int min1;
+    int max1;
+    int64_t count;
+    int64_t sum1;
+    double sum0;
+    double min0;
+    double max0;
+};
+
+/**
+ * @brief Partial aggregate of a single right table row.
+ */
+static inline JoinAggregate row_aggregate(int key, double data0, int data1)
+{
+    JoinAggregate aggregate = {key, data1, data1, 1, data1, data0, data0, data0};
+    return aggregate;
+}
+
+/**
+ * @brief Fold the partial aggregate `b` of the same key into `a`.
+ */
+static inline void merge_aggregate(JoinAggregate &a, const JoinAggregate &b)
+{
+    a.count += b.count;
+    a.sum1 += b.sum1;
+    a.sum0 += b.sum0;
+    a.min0 = std::min(a.min0, b.min0);
+    a.max0 = std::max(a.max0, b.max0);
+    a.min1 = std::min(a.min1, b.min1);
+    a.max1 = std::max(a.max1, b.max1);
+}
+
+/**
+ * @brief Fold the build rows of every key of `table` into one aggregate per
+ * key, in morsels of slots (two passes, as in probe_filter).
+ * With `hits`, only keys with hits are output, and their count and sums
+ * are multiplied by their number of hits, i.e. of matching probe rows.
+ *
+ * @param table Hash table built over the right table keys
+ * @param hits Matching probe rows of every slot of `table`, or NULL to output every key once
+ * @param part Called as part(row) for the partial aggregate of build row `row`
+ * @param[out] out One aggregate per key (appended)
+ * @param n_threads Number of threads to use
+ */
+template <typename Part>
+static void fold_slots(const JoinHashTable &table, const int64_t *hits, Part part, std::vector<JoinAggregate> &out,
+                       int n_threads)
+{
+    int64_t n_slots = table.slots.size();
+    int64_t n_morsels = (n_slots + MORSEL_ROWS - 1) / MORSEL_ROWS;
+    std::vector<int64_t> morsel_out(n_morsels + 1, 0);
+    for_each_morsel(n_threads, n_morsels, [&](int64_t m) {
+        int64_t count = 0;
+        for (int64_t s = m * MORSEL_ROWS; s < std::min(n_slots, (m + 1) * MORSEL_ROWS); s++)
+            count += table.slots[s].count != 0 && (hits == NULL || hits[s] != 0);
+        morsel_out[m + 1] = count;
+    });
+    for (int64_t m = 0; m < n_morsels; m++)
+        morsel_out[m + 1] += morsel_out[m];
+
+    int64_t base = out.size();
+    out.resize(base + morsel_out[n_morsels]);
+    for_each_morsel(n_threads, n_morsels, [&](int64_t m) {
+        JoinAggregate *o = out.data() + base + morsel_out[m];
+        for (int64_t s = m * MORSEL_ROWS; s < std::min(n_slots, (m + 1) * MORSEL_ROWS); s++) {
+            const JoinHashTable::Slot &slot = table.slots[s];
+            if (slot.count == 0 || (hits != NULL && hits[s] == 0))
+                continue;
+            JoinAggregate aggregate = part(table.rows[slot.start]);
+            for (int64_t j = slot.start + 1; j < slot.start + slot.count; j++)
+                merge_aggregate(aggregate, part(table.rows[j]));
+            if (hits != NULL) {
+                aggregate.count *= hits[s];
+                aggregate.sum1 *= hits[s];
+                aggregate.sum0 *= hits[s];
+            }
+            *o++ = aggregate;
+        }
+    });
+}
+
+/**
+ * @brief Fused join and group by key: probe `table` with the left keys,
+ * count the matching left rows of every key, and fold the right rows of
+ * every matched key once, scaled by that count (see fold_slots). The
+ * joined rows themselves are never materialized.
+ *
+ * @param table Hash table built over the right table keys
+ * @param keys Probe keys (left table)
+ * @param n Number of probe keys
+ * @param part Called as part(row) for the partial aggregate of build row `row`
+ * @param[out] out One aggregate per key with a match (appended)
+ * @param n_threads Number of threads to use
+ */
+template <typename Part>
+static void probe_aggregate(const JoinHashTable &table, const int *keys, int64_t n, Part part,
+                            std::vector<JoinAggregate> &out, int n_threads)
+{
+    PhaseTimer timer(PHASE_PROBE);
+    int64_t n_morsels = (n + MORSEL_ROWS - 1) / MORSEL_ROWS;
+    std::vector<const JoinHashTable::Slot *> probe_slots(n);
+    for_each_morsel(n_threads, n_morsels, [&](int64_t m) {
+        int64_t begin = m * MORSEL_ROWS;
+        int64_t end = std::min(n, (m + 1) * MORSEL_ROWS);
+        table.find_batch(keys + begin, end - begin, &probe_slots[begin]);
+    });
+    std::vector<int64_t> hits(table.slots.size(), 0);
+    for (int64_t i = 0; i < n; i++) {
+        if (probe_slots[i] != NULL)
+            hits[probe_slots[i] - table.slots.data()]++;
+    }
+
+    timer.next(PHASE_MATERIALIZE);
+    fold_slots(table, hits.data(), part, out, n_threads);
+}
+
+/**
+ * @brief Join the left keys with the right table and aggregate the joined
+ * rows by key, in one hash probe (see probe_aggregate). The output is what
+ * grouping the inner join output by key would give: one JoinAggregate per
+ * key present in both tables, in no particular order.
+ *
+ * @param keys1 Join key column in the first table
+ * @param keys2 Join key column in the second table
+ * @param data0 First data column in the second table
+ * @param data1 Second data data column in the second table
+ * @param[out] out One aggregate per joined key (old contents are dropped)
+ * @param context Buffers to reuse (default_join_context if NULL)
+ */
+void local_join_aggregate_into(const std::vector<int> &keys1, const std::vector<int> &keys2,
+                               const std::vector<double> &data0, const std::vector<int> &data1,
+                               std::vector<JoinAggregate> &out, JoinContext *context = NULL)
+{
+    JoinHashTable &table = (context ? *context : default_join_context).table;
+    out.clear();
+    {
+        PhaseTimer timer(PHASE_BUILD);
+        table.build_parallel(keys2.data(), keys2.size(), join_config.threads);
+    }
+    JOIN_STAT(record_table(table));
+    probe_aggregate(table, keys1.data(), keys1.size(),
+        [&](int64_t row) { return row_aggregate(keys2[row], data0[row], data1[row]); },
+        out, join_config.threads);
+    JOIN_STAT(join_stats.probe_rows += keys1.size(); join_stats.output_rows += out.size());
+}
+
+/**
+ * @brief Same as local_join_aggregate_into, with the output returned.
+ */
+std::vector<JoinAggregate> local_join_aggregate(const std::vector<int> &keys1, const std::vector<int> &keys2,
+                                                const std::vector<double> &data0, const std::vector<int> &data1,
+                                                JoinContext *context = NULL)
+{
+    std::vector<JoinAggregate> out;
+    local_join_aggregate_into(keys1, keys2, data0, data1, out, context);
+    return out;
+}
+
+/**
+ * @brief Build side pre-aggregation: collapse the right rows of every key
+ * into one partial aggregate, so a key with many duplicates is shuffled once.
+ *
+ * @param keys Key column of the right table (chunk on this rank)
+ * @param data0 First data column of the right table (chunk on this rank)
+ * @param data1 Second data column of the right table (chunk on this rank)
+ * @param[out] partials One partial aggregate per distinct key
+ * @param[out] partial_keys Key of every partial aggregate
+ * @param table Hash table to build the groups in
+ */
+static void pre_aggregate_rows(const std::vector<int> &keys, const std::vector<double> &data0,
+                               const std::vector<int> &data1, std::vector<JoinAggregate> &partials,
+                               std::vector<int> &partial_keys, JoinHashTable &table)
+{
+    PhaseTimer timer(PHASE_BUILD);
+    table.build_parallel(keys.data(), keys.size(), join_config.threads);
+    partials.clear();
+    fold_slots(table, NULL, [&](int64_t row) { return row_aggregate(keys[row], data0[row], data1[row]); },
+               partials, join_config.threads);
+    partial_keys.resize(partials.size());
+    for (size_t i = 0; i < partials.size(); i++)
+        partial_keys[i] = partials[i].key;
+}
+
+/**
+ * @brief Distributed join of two tables on an integer column, fused with a
+ * group by key of the output (see local_join_aggregate_into). Both tables
+ * are shuffled by key as in parallel_join_into, so all rows of a key meet on
+ * one rank and every joined key has exactly one aggregate in the
+ * distributed output.
+ * With `join_config.pre_aggregate` set, the right rows are collapsed into
+ * one partial aggregate per key and rank before the shuffle (see
+ * pre_aggregate_rows), which only moves those partials.
+ * The Bloom filter and hierarchical shuffle options apply; the broadcast
+ * join, skew handling, compression and the pipelined shuffle do not, as
+ * they spread or encode the rows of a key differently.
+ *
+ * @param keys1 Join key column in the first table (chunk on this rank)
+ * @param keys2 Join key column in the second table (chunk on this rank)
+ * @param data0 First data column in the second table (chunk on this rank)
+ * @param data1 Second data data column in the second table (chunk on this rank)
+ * @param[out] out Aggregates of the keys owned by this rank (old contents are dropped)
+ * @param context Buffers to reuse (default_join_context if NULL)
+ */
+void parallel_join_aggregate_into(const std::vector<int> &keys1, const std::vector<int> &keys2,
+                                  const std::vector<double> &data0, const std::vector<int> &data1,
+                                  std::vector<JoinAggregate> &out, JoinContext *context = NULL)
+{
+    JoinContext &ctx = context ? *context : default_join_context;
+    if (n_pes == 1) {
+        local_join_aggregate_into(keys1, keys2, data0, data1, out, &ctx);
+        return;
+    }
+
+    bool pre_aggregate = join_config.pre_aggregate;
+    std::vector<JoinAggregate> partials;
+    std::vector<int> partial_keys;
+    if (pre_aggregate)
+        pre_aggregate_rows(keys2, data0, data1, partials, partial_keys, ctx.table);
+    const std::vector<int> &right_keys = pre_aggregate ? partial_keys : keys2;
+
+    std::vector<int> keys1_filtered;
+    if (join_config.bloom_filter)
+        keys1_filtered = bloom_filter_keys(keys1, right_keys);
+    const std::vector<int> &left_keys = join_config.bloom_filter ? keys1_filtered : keys1;
+
+    assign_partitions(left_keys, right_keys, ctx.partitions);
+    ShufflePlan &left_plan = ctx.left_plan;
+    make_shuffle_plan(left_keys, ctx.partitions, left_plan);
+    std::vector<int> &keys1_recv = ctx.keys1_recv;
+    shuffle_column(left_keys, left_plan, keys1_recv, ctx);
+
+    ShufflePlan &right_plan = ctx.right_plan;
+    make_shuffle_plan(right_keys, ctx.partitions, right_plan);
+    if (!pre_aggregate) {
+        shuffle_rows(keys2, data0, data1, right_plan, ctx.keys2_recv, ctx.data0_recv, ctx.data1_recv, ctx);
+        local_join_aggregate_into(keys1_recv, ctx.keys2_recv, ctx.data0_recv, ctx.data1_recv, out, &ctx);
+        return;
+    }
+
+    // Shuffle the partial aggregates, and merge those of a key while joining
+    PhaseTimer timer(PHASE_PACK);
+    const size_t row_bytes = sizeof(JoinAggregate);
+    std::vector<char> &send = ctx.bytes_send;
+    std::vector<char> &recv = ctx.bytes_recv;
+    arena_resize(send, right_plan.n_send * row_bytes);
+    arena_resize(recv, right_plan.n_recv * row_bytes);
+    JoinAggregate *send_partials = reinterpret_cast<JoinAggregate *>(send.data());
+    const JoinAggregate *recv_partials = reinterpret_cast<const JoinAggregate *>(recv.data());
+    scatter_column(partials, right_plan, send_partials, reinterpret_cast<JoinAggregate *>(recv.data()));
+    timer.next(PHASE_ALLTOALLV);
+    shuffle_alltoallv_bytes(send.data(), right_plan.send_counts, right_plan.send_disp,
+                            recv.data(), right_plan.recv_counts, right_plan.recv_disp, row_bytes);
+    JOIN_STAT(record_shuffle_bytes(right_plan, row_bytes));
+
+    timer.next(PHASE_BUILD);
+    std::vector<int> &keys2_recv = ctx.keys2_recv;
+    arena_resize(keys2_recv, right_plan.n_recv);
+    for (int64_t i = 0; i < right_plan.n_recv; i++)
+        keys2_recv[i] = recv_partials[i].key;
+    JoinHashTable &table = ctx.table;
+    table.build_parallel(keys2_recv.data(), keys2_recv.size(), join_config.threads);
+    timer.stop();
+    JOIN_STAT(record_table(table));
+
+    out.clear();
+    probe_aggregate(table, keys1_recv.data(), keys1_recv.size(),
+        [&](int64_t row) { return recv_partials[row]; }, out, join_config.threads);
+    JOIN_STAT(join_stats.probe_rows += keys1_recv.size(); join_stats.output_rows += out.size());
+}
+
+/**
+ * @brief Same as parallel_join_aggregate_into, with the output returned.
+ */
+std::vector<JoinAggregate> parallel_join_aggregate(const std::vector<int> &keys1, const std::vector<int> &keys2,
+                                                   const std::vector<double> &data0, const std::vector<int> &data1,
+                                                   JoinContext *context = NULL)
+{
+    std::vector<JoinAggregate> out;
+    parallel_join_aggregate_into(keys1, keys2, data0, data1, out, context);
+    return out;
+}
+
+// COLUMN-GENERIC JOIN
+
+template <size_t... I>
+struct IndexSeq {};
+
+template <size_t N, size_t... I>
+struct MakeIndexSeq : MakeIndexSeq<N - 1, N - 1, I...> {};
+
+template <size_t... I>
+struct MakeIndexSeq<0, I...> {
+    typedef IndexSeq<I...> type;
+};
+
+/**
+ * @brief Size in bytes of a packed right table row: the key followed by
+ * one field of every payload column, without padding.
+ */
+template <typename... Cols>
+struct PackedRowSize;
+
+template <>
+struct PackedRowSize<> {
+    static const size_t value = sizeof(int);
+};
+
+template <typename T, typename... Rest>
+struct PackedRowSize<T, Rest...> {
+    static const size_t value = sizeof(T) + PackedRowSize<Rest...>::value;
+};
+
+/**
+ * @brief Hash join of the left keys with the right keys only. For every
+ * match, the index of the matching right row is emitted, and optionally the
+ * key and the index of the left row, so the payload columns can be gathered
+ * afterwards whatever their types.
+ *
+ * @param keys1 Left keys
+ * @param n1 Number of left keys
+ * @param keys2 Right keys
+ * @param n2 Number of right keys
+ * @param[out] keys_result Key of every match (optional)
+ * @param[out] left_idx Left row of every match (optional)
+ * @param[out] right_idx Right row of every match
+ * @param table Hash table to build (whose capacity is reused)
+ */
+static void join_indices(const int *keys1, int64_t n1, const int *keys2, int64_t n2,
+                         std::vector<int> *keys_result, std::vector<int64_t> *left_idx,
+                         std::vector<int64_t> &right_idx, JoinHashTable &table)
+{
+    table.build_parallel(keys2, n2, join_config.threads);
+    probe_two_pass(table, keys1, n1, join_config.threads,
+        [&](int64_t n_out) {
+            if (keys_result != NULL)
+                keys_result->resize(n_out);
+            if (left_idx != NULL)
+                left_idx->resize(n_out);
+            right_idx.resize(n_out);
+        },
+        [&](int64_t out, int64_t i, int64_t index) {
+            if (keys_result != NULL)
+                (*keys_result)[out] = keys1[i];
+            if (left_idx != NULL)
+                (*left_idx)[out] = i;
+            right_idx[out] = index;
+        });
+}
+
+/**
+ * @brief Gather the rows `right_idx` of a payload column into a new column.
+ */
+template <typename T>
+static std::vector<T> gather_column(const std::vector<T> &col, const std::vector<int64_t> &right_idx)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "join payload columns must be trivially copyable");
+    int64_t n = right_idx.size();
+    std::vector<T> out(n);
+    for_each_morsel(join_config.threads, (n + MORSEL_ROWS - 1) / MORSEL_ROWS, [&](int64_t m) {
+        for (int64_t i = m * MORSEL_ROWS; i < std::min(n, (m + 1) * MORSEL_ROWS); i++)
+            out[i] = col[right_idx[i]];
+    });
+    return out;
+}
+
+/**
+ * @brief Gather the field at byte `offset` of the packed rows `right_idx`
+ * into a new column.
+ */
+template <typename T>
+static std::vector<T> gather_packed_column(const char *rows, size_t row_bytes, size_t offset,
+                                           const std::vector<int64_t> &right_idx)
+{
+    int64_t n = right_idx.size();
+    std::vector<T> out(n);
+    for_each_morsel(join_config.threads, (n + MORSEL_ROWS - 1) / MORSEL_ROWS, [&](int64_t m) {
+        for (int64_t i = m * MORSEL_ROWS; i < std::min(n, (m + 1) * MORSEL_ROWS); i++)
+            std::memcpy(&out[i], rows + right_idx[i] * row_bytes + offset, sizeof(T));
+    });
+    return out;
+}
+
+/**
+ * @brief Pack one column into the rows of the shuffle at byte `offset`:
+ * rows for other ranks go to the send buffer, and rows of the self
+ * partition directly into the receive buffer (see scatter_column).
+ */
+template <typename T>
+static void pack_column(const std::vector<T> &col, const ShufflePlan &plan, size_t row_bytes, size_t offset,
+                        char *send, char *recv)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "join payload columns must be trivially copyable");
+    int64_t self_base = plan.recv_disp[rank] - plan.n_send;
+    for (size_t i = 0; i < col.size(); i++) {
+        int64_t pos = plan.send_pos[i];
+        if (pos < 0)
+            continue;
+        if (pos < plan.n_send)
+            std::memcpy(send + pos * row_bytes + offset, &col[i], sizeof(T));
+        else
+            std::memcpy(recv + (self_base + pos) * row_bytes + offset, &col[i], sizeof(T));
+    }
+}
+
+template <size_t Offset>
+static void pack_columns(const ShufflePlan &, size_t, char *, char *)
+{
+}
+
+template <size_t Offset, typename T, typename... Rest>
+static void pack_columns(const ShufflePlan &plan, size_t row_bytes, char *send, char *recv,
+                         const std::vector<T> &col, const std::vector<Rest> &...rest)
+{
+    pack_column(col, plan, row_bytes, Offset, send, recv);
+    pack_columns<Offset + sizeof(T)>(plan, row_bytes, send, recv, rest...);
+}
+
+template <size_t Offset>
+static void gather_packed_columns(const char *, size_t, const std::vector<int64_t> &)
+{
+}
+
+template <size_t Offset, typename T, typename... Rest>
+static void gather_packed_columns(const char *rows, size_t row_bytes, const std::vector<int64_t> &right_idx,
+                                  std::vector<T> &out, std::vector<Rest> &...rest)
+{
+    out = gather_packed_column<T>(rows, row_bytes, Offset, right_idx);
+    gather_packed_columns<Offset + sizeof(T)>(rows, row_bytes, right_idx, rest...);
+}
+
+template <typename... Cols, size_t... I>
+static void gather_packed_output(const char *rows, const std::vector<int64_t> &right_idx,
+                                 std::tuple<std::vector<int>, std::vector<Cols>...> &output, IndexSeq<I...>)
+{
+    gather_packed_columns<sizeof(int)>(rows, PackedRowSize<Cols...>::value, right_idx,
+                                       std::get<I + 1>(output)...);
+}
 
 /**
- * @brief Performant implementation of local join.
- * The left table only has the key column (keys1) which needs
- * to be joined with the first column (keys2) in the right table.
- * data0 and data1 are the 2nd and 3rd columns in the right table.
+ * @brief Local join of the left keys with a right table that has any
+ * number of payload columns of any trivially copyable type (integers,
+ * floating point, fixed-width strings such as std::array<char, N>, ...).
+ * Matches are found with the hash engine on the keys only, and every
+ * payload column is then gathered with a loop specialized for its type.
+ *
+ * The context comes first, as nothing can follow the deduced columns;
+ * the overload without one uses default_join_context.
  *
+ * @param context Buffers to reuse (default_join_context if NULL)
  * @param keys1 Join key column in the first table
  * @param keys2 Join key column in the second table
- * @param data0 First data column in the second table
- * @param data1 Second data data column in the second table
- * @return std::tuple<std::vector<int>, std::vector<double>, std::vector<int>>
- *  Resulting distributed output (key and data columns from the right table)
+ * @param cols Payload columns of the second table
+ * @return std::tuple<std::vector<int>, std::vector<Cols>...>
+ *  Resulting output (key and payload columns from the right table)
  */
-std::tuple<std::vector<int>, std::vector<double>, std::vector<int>> local_join_impl(
-    std::vector<int> &keys1,
-    std::vector<int> &keys2, std::vector<double> &data0, std::vector<int> &data1)
+template <typename... Cols>
+std::tuple<std::vector<int>, std::vector<Cols>...> local_join_columns(
+    JoinContext *context, const std::vector<int> &keys1, const std::vector<int> &keys2,
+    const std::vector<Cols> &...cols)
+{
+    std::vector<int> keys_result;
+    std::vector<int64_t> right_idx;
+    join_indices(keys1.data(), keys1.size(), keys2.data(), keys2.size(), &keys_result, NULL, right_idx,
+                 (context ? *context : default_join_context).table);
+    return std::make_tuple(std::move(keys_result), gather_column(cols, right_idx)...);
+}
+
+/**
+ * @brief Same as local_join_columns with a context, using default_join_context.
+ */
+template <typename... Cols>
+std::tuple<std::vector<int>, std::vector<Cols>...> local_join_columns(
+    const std::vector<int> &keys1, const std::vector<int> &keys2, const std::vector<Cols> &...cols)
+{
+    return local_join_columns(static_cast<JoinContext *>(NULL), keys1, keys2, cols...);
+}
+
+/**
+ * @brief Distributed join of the left keys with a right table that has any
+ * number of payload columns of any trivially copyable type.
+ * Tables are hash partitioned and shuffled like in parallel_join_impl, but
+ * the right table rows are packed with all their payload columns into one
+ * byte buffer (see PackedRowSize), so the whole table moves in a single
+ * MPI_Alltoallv whatever the number of columns. The payload columns are
+ * gathered straight from the received packed rows.
+ * `join_config.bloom_filter` applies as in parallel_join_impl; the
+ * broadcast join and skew handling are not used by this function.
+ * As in local_join_columns, the context comes first, and the overload
+ * without one uses default_join_context.
+ *
+ * @param context Buffers to reuse (default_join_context if NULL)
+ * @param keys1 Join key column in the first table (chunk on this rank)
+ * @param keys2 Join key column in the second table (chunk on this rank)
+ * @param cols Payload columns of the second table (chunk on this rank)
+ * @return std::tuple<std::vector<int>, std::vector<Cols>...>
+ *  Resulting distributed output (key and payload columns from the right table)
+ */
+template <typename... Cols>
+std::tuple<std::vector<int>, std::vector<Cols>...> parallel_join_columns(
+    JoinContext *context, const std::vector<int> &keys1, const std::vector<int> &keys2,
+    const std::vector<Cols> &...cols)
+{
+    if (n_pes == 1)
+        return local_join_columns(context, keys1, keys2, cols...);
+
+    bool bloom_filter = join_config.bloom_filter;
+    std::vector<int> keys1_filtered;
+    if (bloom_filter)
+        keys1_filtered = bloom_filter_keys(keys1, keys2);
+    const std::vector<int> &left_keys = bloom_filter ? keys1_filtered : keys1;
+
+    JoinContext &ctx = context ? *context : default_join_context;
+    assign_partitions(left_keys, keys2, ctx.partitions);
+    ShufflePlan &left_plan = ctx.left_plan;
+    make_shuffle_plan(left_keys, ctx.partitions, left_plan);
+    std::vector<int> &keys1_recv = ctx.keys1_recv;
+    shuffle_column(left_keys, left_plan, keys1_recv, ctx);
+
+    const size_t row_bytes = PackedRowSize<Cols...>::value;
+    ShufflePlan &right_plan = ctx.right_plan;
+    make_shuffle_plan(keys2, ctx.partitions, right_plan);
+    std::vector<char> &send = ctx.bytes_send;
+    std::vector<char> &recv = ctx.bytes_recv;
+    arena_resize(send, right_plan.n_send * row_bytes);
+    arena_resize(recv, right_plan.n_recv * row_bytes);
+    pack_columns<0>(right_plan, row_bytes, send.data(), recv.data(), keys2, cols...);
+    shuffle_alltoallv_bytes(send.data(), right_plan.send_counts, right_plan.send_disp,
+                            recv.data(), right_plan.recv_counts, right_plan.recv_disp, row_bytes);
+    JOIN_STAT(record_shuffle_bytes(right_plan, row_bytes));
+
+    std::vector<int> &keys2_recv = ctx.keys2_recv;
+    arena_resize(keys2_recv, right_plan.n_recv);
+    for (int64_t i = 0; i < right_plan.n_recv; i++)
+        std::memcpy(&keys2_recv[i], &recv[i * row_bytes], sizeof(int));
+
+    std::tuple<std::vector<int>, std::vector<Cols>...> output;
+    std::vector<int64_t> right_idx;
+    join_indices(keys1_recv.data(), keys1_recv.size(), keys2_recv.data(), keys2_recv.size(),
+                 &std::get<0>(output), NULL, right_idx, ctx.table);
+    gather_packed_output<Cols...>(recv.data(), right_idx, output, typename MakeIndexSeq<sizeof...(Cols)>::type());
+    return output;
+}
+
+/**
+ * @brief Same as parallel_join_columns with a context, using default_join_context.
+ */
+template <typename... Cols>
+std::tuple<std::vector<int>, std::vector<Cols>...> parallel_join_columns(
+    const std::vector<int> &keys1, const std::vector<int> &keys2, const std::vector<Cols> &...cols)
+{
+    return parallel_join_columns(static_cast<JoinContext *>(NULL), keys1, keys2, cols...);
+}
+
+// LATE MATERIALIZATION
+
+/**
+ * @brief Global row ids of a distributed table: the rows of rank p are
+ * numbered from offsets[p] to offsets[p + 1] - 1, in local order.
+ *
+ * @param n Number of rows on this rank
+ * @return std::vector<int64_t> Row id offsets of all ranks (`n_pes + 1` elements)
+ */
+static std::vector<int64_t> global_row_offsets(int64_t n)
+{
+    std::vector<int64_t> offsets(n_pes + 1, 0);
+    allgather_int64(&n, 1, offsets.data() + 1);
+    for (int p = 0; p < n_pes; p++)
+        offsets[p + 1] += offsets[p];
+    return offsets;
+}
+
+/**
+ * @brief Shuffle a key column together with the global row ids of its rows
+ * (`first_id`, `first_id + 1`, ...), packed so both move in one MPI_Alltoallv.
+ *
+ * @param keys Key column to shuffle (chunk on this rank)
+ * @param first_id Global row id of the first local row
+ * @param plan Shuffle layout of the key column
+ * @param[out] keys_recv Received keys
+ * @param[out] ids_recv Global row ids of the received keys
+ * @param context Buffers to reuse for the packed rows
+ */
+static void shuffle_keys_ids(const std::vector<int> &keys, int64_t first_id, ShufflePlan &plan,
+                             std::vector<int> &keys_recv, std::vector<int64_t> &ids_recv, JoinContext &context)
+{
+    std::vector<int64_t> ids(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+        ids[i] = first_id + i;
+
+    const size_t row_bytes = PackedRowSize<int64_t>::value;
+    std::vector<char> &send = context.bytes_send;
+    std::vector<char> &recv = context.bytes_recv;
+    arena_resize(send, plan.n_send * row_bytes);
+    arena_resize(recv, plan.n_recv * row_bytes);
+    pack_columns<0>(plan, row_bytes, send.data(), recv.data(), keys, ids);
+    shuffle_alltoallv_bytes(send.data(), plan.send_counts, plan.send_disp,
+                            recv.data(), plan.recv_counts, plan.recv_disp, row_bytes);
+    JOIN_STAT(record_shuffle_bytes(plan, row_bytes));
+
+    arena_resize(keys_recv, plan.n_recv);
+    ids_recv.resize(plan.n_recv);
+    for (int64_t i = 0; i < plan.n_recv; i++) {
+        std::memcpy(&keys_recv[i], &recv[i * row_bytes], sizeof(int));
+        std::memcpy(&ids_recv[i], &recv[i * row_bytes + sizeof(int)], sizeof(int64_t));
+    }
+}
+
+/**
+ * @brief Local join that only returns which rows matched instead of copying
+ * the payload columns. The payloads can then be materialized on demand with
+ * gather_column, and only for the columns that are actually read.
+ *
+ * @param keys1 Join key column in the first table
+ * @param keys2 Join key column in the second table
+ * @param left_indices Whether the left row of every match is returned too
+ * @param context Buffers to reuse (default_join_context if NULL)
+ * @return std::tuple<std::vector<int64_t>, std::vector<int64_t>>
+ *  Row of keys1 (empty unless `left_indices`) and row of keys2 of every match
+ */
+std::tuple<std::vector<int64_t>, std::vector<int64_t>> local_join_indices(
+    const std::vector<int> &keys1, const std::vector<int> &keys2, bool left_indices = true,
+    JoinContext *context = NULL)
+{
+    std::vector<int64_t> left_idx;
+    std::vector<int64_t> right_idx;
+    join_indices(keys1.data(), keys1.size(), keys2.data(), keys2.size(),
+                 NULL, left_indices ? &left_idx : NULL, right_idx, (context ? *context : default_join_context).table);
+    return std::make_tuple(std::move(left_idx), std::move(right_idx));
+}
+
+/**
+ * @brief Distributed variant of local_join_indices.
+ * Only the keys and the global row ids (see global_row_offsets) of both
+ * tables are shuffled, so no payload bytes move at all. Every match is
+ * returned as a pair of global row ids, and fetch_column materializes a
+ * payload column for them from the ranks that own the rows.
+ *
+ * @param keys1 Join key column in the first table (chunk on this rank)
+ * @param keys2 Join key column in the second table (chunk on this rank)
+ * @param left_indices Whether the left row of every match is returned too
+ * @param context Buffers to reuse (default_join_context if NULL)
+ * @return std::tuple<std::vector<int64_t>, std::vector<int64_t>>
+ *  Global row id in the first table (empty unless `left_indices`) and in
+ *  the second table of every match on this rank
+ */
+std::tuple<std::vector<int64_t>, std::vector<int64_t>> parallel_join_indices(
+    const std::vector<int> &keys1, const std::vector<int> &keys2, bool left_indices = true,
+    JoinContext *context = NULL)
+{
+    if (n_pes == 1)
+        return local_join_indices(keys1, keys2, left_indices, context);
+
+    JoinContext &ctx = context ? *context : default_join_context;
+    assign_partitions(keys1, keys2, ctx.partitions);
+    ShufflePlan &left_plan = ctx.left_plan;
+    make_shuffle_plan(keys1, ctx.partitions, left_plan);
+    std::vector<int> &keys1_recv = ctx.keys1_recv;
+    std::vector<int64_t> left_ids;
+    if (left_indices)
+        shuffle_keys_ids(keys1, global_row_offsets(keys1.size())[rank], left_plan, keys1_recv, left_ids, ctx);
+    else
+        shuffle_column(keys1, left_plan, keys1_recv, ctx);
+
+    ShufflePlan &right_plan = ctx.right_plan;
+    make_shuffle_plan(keys2, ctx.partitions, right_plan);
+    std::vector<int> &keys2_recv = ctx.keys2_recv;
+    std::vector<int64_t> right_ids;
+    shuffle_keys_ids(keys2, global_row_offsets(keys2.size())[rank], right_plan, keys2_recv, right_ids, ctx);
+
+    std::vector<int64_t> left_idx;
+    std::vector<int64_t> right_idx;
+    join_indices(keys1_recv.data(), keys1_recv.size(), keys2_recv.data(), keys2_recv.size(),
+                 NULL, left_indices ? &left_idx : NULL, right_idx, ctx.table);
+    for (size_t i = 0; i < left_idx.size(); i++)
+        left_idx[i] = left_ids[left_idx[i]];
+    for (size_t i = 0; i < right_idx.size(); i++)
+        right_idx[i] = right_ids[right_idx[i]];
+    return std::make_tuple(std::move(left_idx), std::move(right_idx));
+}
+
+/**
+ * @brief Materialize a distributed column for a list of global row ids
+ * (see parallel_join_indices). The ids are sent to the ranks that own the
+ * rows, which answer with the values, so only the requested rows of this
+ * one column move.
+ *
+ * @param col Column to read from (chunk on this rank)
+ * @param ids Global row ids to read
+ * @return std::vector<T> Value of `col` at every id, in the order of `ids`
+ */
+template <typename T>
+std::vector<T> fetch_column(const std::vector<T> &col, const std::vector<int64_t> &ids)
+{
+    if (n_pes == 1)
+        return gather_column(col, ids);
+
+    std::vector<int64_t> offsets = global_row_offsets(col.size());
+    ShufflePlan plan;
+    plan.send_pos.resize(ids.size());
+    std::vector<int64_t> local_ids(ids.size());
+    for (size_t i = 0; i < ids.size(); i++) {
+        int owner = std::upper_bound(offsets.begin(), offsets.end(), ids[i]) - offsets.begin() - 1;
+        plan.send_pos[i] = owner;
+        local_ids[i] = ids[i] - offsets[owner];
+    }
+    finish_shuffle_plan(plan);
+
+    // Requests out, then the answers back along the reversed layout
+    std::vector<int64_t> requests_send(plan.n_send);
+    std::vector<int64_t> requests_recv(plan.n_recv);
+    scatter_column(local_ids, plan, requests_send.data(), requests_recv.data());
+    shuffle_alltoallv(requests_send.data(), plan.send_counts, plan.send_disp,
+                      requests_recv.data(), plan.recv_counts, plan.recv_disp, MPI_LONG_LONG_INT);
+    std::vector<T> answers = gather_column(col, requests_recv);
+    std::vector<T> values(plan.n_send);
+    shuffle_alltoallv_bytes(reinterpret_cast<char *>(answers.data()), plan.recv_counts, plan.recv_disp,
+                            reinterpret_cast<char *>(values.data()), plan.send_counts, plan.send_disp, sizeof(T));
+    JOIN_STAT(record_shuffle_bytes(plan, sizeof(int64_t));
+              join_stats.bytes_sent += (plan.n_recv - plan.n_self) * sizeof(T);
+              join_stats.bytes_recv += plan.n_send * sizeof(T));
+
+    std::vector<T> out(ids.size());
+    int64_t self_base = plan.recv_disp[rank] - plan.n_send;
+    for (size_t i = 0; i < ids.size(); i++) {
+        int64_t pos = plan.send_pos[i];
+        out[i] = pos < plan.n_send ? values[pos] : answers[self_base + pos];
+    }
+    return out;
+}
+
+// STREAMING JOIN
+
+/**
+ * @brief Batch readers of streaming_join. A source replaces the batch
+ * columns with the next rows of its table chunk (at most `max_rows`) and
+ * returns how many there are, 0 once the chunk is exhausted.
+ */
+typedef std::function<int64_t(int64_t max_rows, std::vector<int> &keys)> LeftBatchSource;
+typedef std::function<int64_t(int64_t max_rows, std::vector<int> &keys, std::vector<double> &data0,
+                              std::vector<int> &data1)> RightBatchSource;
+
+/**
+ * @brief Consumer of the streaming_join output, called once per output batch.
+ */
+typedef std::function<void(const std::vector<int> &keys, const std::vector<double> &data0,
+                           const std::vector<int> &data1)> OutputSink;
+
+/**
+ * @brief Copy rows [begin, begin + n) of a column into a batch.
+ */
+template <typename T>
+static void read_batch(const T *col, int64_t begin, int64_t n, std::vector<T> &batch)
+{
+    batch.assign(col + begin, col + begin + n);
+}
+
+/**
+ * @brief Source over an in-memory left table chunk (which must outlive it).
+ */
+LeftBatchSource vector_left_source(const std::vector<int> &keys)
+{
+    std::shared_ptr<int64_t> cursor(new int64_t(0));
+    return [&keys, cursor](int64_t max_rows, std::vector<int> &batch) -> int64_t {
+        int64_t n = std::min<int64_t>(max_rows, keys.size() - *cursor);
+        read_batch(keys.data(), *cursor, n, batch);
+        *cursor += n;
+        return n;
+    };
+}
+
+/**
+ * @brief Source over an in-memory right table chunk (which must outlive it).
+ */
+RightBatchSource vector_right_source(const std::vector<int> &keys, const std::vector<double> &data0,
+                                     const std::vector<int> &data1)
+{
+    std::shared_ptr<int64_t> cursor(new int64_t(0));
+    return [&keys, &data0, &data1, cursor](int64_t max_rows, std::vector<int> &batch_keys,
+                                           std::vector<double> &batch_data0, std::vector<int> &batch_data1) -> int64_t {
+        int64_t n = std::min<int64_t>(max_rows, keys.size() - *cursor);
+        read_batch(keys.data(), *cursor, n, batch_keys);
+        read_batch(data0.data(), *cursor, n, batch_data0);
+        read_batch(data1.data(), *cursor, n, batch_data1);
+        *cursor += n;
+        return n;
+    };
+}
+
+// rows buffered per spill partition before they are written out
+static const int64_t SPILL_BUFFER_ROWS = 4096;
+
+// times a spill partition over the memory budget is split again, before it
+// is joined with a block nested loop instead
+static const int SPILL_MAX_DEPTH = 3;
+
+/**
+ * @brief Partition files of a grace hash join: rows are appended to one of
+ * `n` temporary files, and read back one partition at a time. The files
+ * are created in `join_config.spill_dir` and unlinked right away, so they
+ * disappear when they are closed, even if the job dies.
+ */
+template <typename T>
+struct SpillPartitions {
+    std::vector<FILE *> files;
+    std::vector<std::vector<T> > buffers;
+    std::vector<int64_t> rows;
+
+    explicit SpillPartitions(int n)
+        : files(n, NULL), buffers(n), rows(n, 0)
+    {
+        for (int f = 0; f < n; f++) {
+            std::string path = join_config.spill_dir + "/join_spill_XXXXXX";
+            std::vector<char> name(path.begin(), path.end());
+            name.push_back('\0');
+            int fd = mkstemp(name.data());
+            if (fd < 0 || (files[f] = fdopen(fd, "w+b")) == NULL) {
+                std::cerr << "Rank " << rank << ": cannot create a spill file in " << join_config.spill_dir << std::endl;
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            unlink(name.data());
+        }
+    }
+
+    ~SpillPartitions()
+    {
+        for (size_t f = 0; f < files.size(); f++)
+            fclose(files[f]);
+    }
+
+    SpillPartitions(const SpillPartitions &) = delete;
+    SpillPartitions &operator=(const SpillPartitions &) = delete;
+
+    void add(int f, const T &row)
+    {
+        buffers[f].push_back(row);
+        if ((int64_t)buffers[f].size() >= SPILL_BUFFER_ROWS)
+            flush(f);
+    }
+
+    void flush(int f)
+    {
+        if (fwrite(buffers[f].data(), sizeof(T), buffers[f].size(), files[f]) != buffers[f].size()) {
+            std::cerr << "Rank " << rank << ": cannot write to " << join_config.spill_dir << std::endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        rows[f] += buffers[f].size();
+        buffers[f].clear();
+    }
+
+    /**
+     * @brief Flush all buffers and rewind every file for reading.
+     */
+    void finish()
+    {
+        for (size_t f = 0; f < files.size(); f++) {
+            flush(f);
+            std::vector<T>().swap(buffers[f]);
+            rewind(files[f]);
+        }
+    }
+
+    /**
+     * @brief Read partition `f` again from its first row.
+     */
+    void restart(int f)
+    {
+        fseek(files[f], 0, SEEK_SET);
+    }
+
+    /**
+     * @brief Read the next (at most `max_rows`) rows of partition `f`.
+     */
+    int64_t read(int f, int64_t max_rows, std::vector<T> &batch)
+    {
+        batch.resize(max_rows);
+        int64_t n = fread(batch.data(), sizeof(T), max_rows, files[f]);
+        batch.resize(n);
+        return n;
+    }
+};
+
+/**
+ * @brief Spill partition of a key, independent of its rank (see key_partition).
+ * Every `seed` gives a different split, for partitions that are split again.
+ */
+static inline int spill_partition(int key, int n_partitions, int seed = 0)
 {
+    return (uint64_t(mix_key(key ^ int(0x9E3779B9U * uint32_t(seed)))) * n_partitions) >> 32;
+}
 
-    // TODO Add your implementation here...
+/**
+ * @brief Join the left keys of a batch with hash table `table` over the
+ * right columns and hand the matches to `sink`.
+ */
+static void probe_batch(const JoinHashTable &table, const std::vector<int> &keys, const std::vector<double> &data0,
+                        const std::vector<int> &data1, const OutputSink &sink)
+{
     std::vector<int> keys_result;
     std::vector<double> data0_result;
     std::vector<int> data1_result;
+    probe_append(table, keys.data(), keys.size(), data0.data(), data1.data(),
+                 keys_result, data0_result, data1_result, join_config.threads);
+    if (!keys_result.empty())
+        sink(keys_result, data0_result, data1_result);
+}
+
+/**
+ * @brief Join partition `f` of the spilled right and left rows of
+ * streaming_join. A right partition of at most `budget_rows` rows is read
+ * whole into hash table `table`. A larger one (a skewed key, or too few
+ * spill partitions for the input) is split again with the next seed of
+ * spill_partition, and the pieces are joined recursively. Once a split no
+ * longer shrinks it (a single heavy key) or SPILL_MAX_DEPTH is reached, it is
+ * read in chunks of `budget_rows` rows instead, and every chunk is joined
+ * with a full pass over the left partition (block nested loop).
+ */
+static void join_spill_partition(SpillPartitions<JoinRow> &right, SpillPartitions<int> &left, int f, int depth,
+                                 int64_t budget_rows, JoinHashTable &table, const OutputSink &sink)
+{
+    const int64_t batch_rows = join_config.batch_rows;
+    const int n_partitions = right.files.size();
+    const int64_t right_rows = right.rows[f];
+    if (right_rows == 0 || left.rows[f] == 0)
+        return;
 
-    for(const auto& k : keys1) {
-        auto p = std::find(keys2.begin(), keys2.end(), k);
-        if (p != keys2.end()) {
-            int index = p - keys2.begin();
-            keys_result.push_back(*p);
-            data0_result.push_back(data0[index]);
-            data1_result.push_back(data1[index]);
+    std::vector<JoinRow> rows;
+    std::vector<int> keys;
+    if (right_rows > budget_rows && depth < SPILL_MAX_DEPTH && n_partitions > 1) {
+        SpillPartitions<JoinRow> right_split(n_partitions);
+        SpillPartitions<int> left_split(n_partitions);
+        while (right.read(f, batch_rows, rows) > 0) {
+            for (size_t i = 0; i < rows.size(); i++)
+                right_split.add(spill_partition(rows[i].key, n_partitions, depth + 1), rows[i]);
         }
+        while (left.read(f, batch_rows, keys) > 0) {
+            for (size_t i = 0; i < keys.size(); i++)
+                left_split.add(spill_partition(keys[i], n_partitions, depth + 1), keys[i]);
+        }
+        right_split.finish();
+        left_split.finish();
+        std::vector<JoinRow>().swap(rows);
+        std::vector<int>().swap(keys);
+        int64_t largest = *std::max_element(right_split.rows.begin(), right_split.rows.end());
+        int next_depth = largest < right_rows ? depth + 1 : SPILL_MAX_DEPTH;
+        for (int g = 0; g < n_partitions; g++)
+            join_spill_partition(right_split, left_split, g, next_depth, budget_rows, table, sink);
+        return;
     }
 
-    // This is a dummy return for compilation purposes, replace this with your implementation
-    return std::make_tuple(keys_result, data0_result, data1_result);
+    std::vector<double> data0;
+    std::vector<int> data1;
+    for (int64_t done = 0; done < right_rows; done += keys.size()) {
+        right.read(f, std::min(budget_rows, right_rows - done), rows);
+        keys.resize(rows.size());
+        data0.resize(rows.size());
+        data1.resize(rows.size());
+        unpack_rows(rows.data(), 0, rows.size(), keys.data(), data0.data(), data1.data());
+        std::vector<JoinRow>().swap(rows);
+        if (keys.empty())
+            break;
+        table.build_parallel(keys.data(), keys.size(), join_config.threads);
+        std::vector<int> left_keys;
+        left.restart(f);
+        while (left.read(f, batch_rows, left_keys) > 0)
+            probe_batch(table, left_keys, data0, data1, sink);
+    }
 }
 
 /**
- * @brief Distributed join implementation for joining two tables
- * on an integer column.
+ * @brief Distributed join over inputs read in batches, with bounded memory.
+ * The right table is shuffled one batch at a time (one MPI_Alltoallv per
+ * batch round, until every rank's source is exhausted). Its received rows
+ * stay in memory as long as they fit in `join_config.memory_budget`; beyond
+ * that, all of them are hash partitioned to `join_config.spill_partitions`
+ * temporary files (grace hash join). The left table is then shuffled batch
+ * by batch as well: every received batch is probed right away against the
+ * in-memory right rows, or spilled to the matching partition files, which
+ * are then joined one pair at a time (see join_spill_partition, which
+ * splits partitions that are still over the budget). Output is delivered to
+ * `sink` in batches, so memory stays bounded by the batch size and the budget.
  *
- * @param keys1 Join key column in the first table (chunk on this rank)
- * @param keys2 Join key column in the second table (chunk on this rank)
- * @param data0 First data column in the second table (chunk on this rank)
- * @param data1 Second data data column in the second table (chunk on this rank)
- * @return std::tuple<std::vector<int>, std::vector<double>, std::vector<int>>
- *  Resulting distributed output (key and data columns from the right table)
+ * @param left Left table source (chunk on this rank)
+ * @param right Right table source (chunk on this rank)
+ * @param sink Called with every batch of output rows on this rank
+ * @param context Buffers to reuse for the shuffled batches and the hash
+ *  table (default_join_context if NULL)
  */
+void streaming_join(LeftBatchSource left, RightBatchSource right, OutputSink sink, JoinContext *context = NULL)
+{
+    JoinContext &ctx = context ? *context : default_join_context;
+    const int64_t batch_rows = join_config.batch_rows;
+    const int64_t budget_rows = std::max<int64_t>(1, join_config.memory_budget / sizeof(JoinRow));
+    const int n_partitions = join_config.spill_partitions;
+    // Batches are shuffled before the whole tables are seen, so partitions are not balanced by size
+    default_partitions(ctx.partitions);
 
-//void alltoallv_int(int *send_buffer, std::vector<int> &send_counts, std::vector<int> &send_disp,
-//                   int *recv_buffer, std::vector<int> &recv_counts, std::vector<int> &recv_disp)
+    // Right table: shuffle batch by batch, spill once over the budget
+    std::vector<int> batch_keys;
+    std::vector<double> batch_data0;
+    std::vector<int> batch_data1;
+    std::vector<int> &recv_keys = ctx.keys2_recv;
+    std::vector<double> &recv_data0 = ctx.data0_recv;
+    std::vector<int> &recv_data1 = ctx.data1_recv;
+    std::vector<int> right_keys;
+    std::vector<double> right_data0;
+    std::vector<int> right_data1;
+    std::unique_ptr<SpillPartitions<JoinRow> > right_spill;
+    while (true) {
+        int64_t n = right(batch_rows, batch_keys, batch_data0, batch_data1);
+        if (allreduce_sum_scalar(int(n > 0)) == 0)
+            break;
+        ShufflePlan &plan = ctx.right_plan;
+        make_shuffle_plan(batch_keys, ctx.partitions, plan);
+        shuffle_rows(batch_keys, batch_data0, batch_data1, plan, recv_keys, recv_data0, recv_data1, ctx);
+        right_keys.insert(right_keys.end(), recv_keys.begin(), recv_keys.end());
+        right_data0.insert(right_data0.end(), recv_data0.begin(), recv_data0.end());
+        right_data1.insert(right_data1.end(), recv_data1.begin(), recv_data1.end());
 
-std::tuple<std::vector<int>, std::vector<double>, std::vector<int>> parallel_join_impl(
-    std::vector<int> &keys1, std::vector<int> &keys2, std::vector<double> &data0, std::vector<int> &data1)
+        if (!right_spill && (int64_t)right_keys.size() > budget_rows)
+            right_spill.reset(new SpillPartitions<JoinRow>(n_partitions));
+        if (right_spill) {
+            for (size_t i = 0; i < right_keys.size(); i++) {
+                JoinRow row = {right_keys[i], right_data1[i], right_data0[i]};
+                right_spill->add(spill_partition(right_keys[i], n_partitions), row);
+            }
+            right_keys.clear();
+            right_data0.clear();
+            right_data1.clear();
+        }
+    }
+
+    // Left table: shuffle batch by batch, then probe or spill every batch
+    JoinHashTable &table = ctx.table;
+    std::unique_ptr<SpillPartitions<int> > left_spill;
+    if (right_spill) {
+        std::vector<int>().swap(right_keys);
+        std::vector<double>().swap(right_data0);
+        std::vector<int>().swap(right_data1);
+        right_spill->finish();
+        left_spill.reset(new SpillPartitions<int>(n_partitions));
+    } else {
+        table.build_parallel(right_keys.data(), right_keys.size(), join_config.threads);
+    }
+    while (true) {
+        int64_t n = left(batch_rows, batch_keys);
+        if (allreduce_sum_scalar(int(n > 0)) == 0)
+            break;
+        ShufflePlan &plan = ctx.left_plan;
+        make_shuffle_plan(batch_keys, ctx.partitions, plan);
+        std::vector<int> &recv_left = ctx.keys1_recv;
+        shuffle_column(batch_keys, plan, recv_left, ctx);
+        if (!left_spill) {
+            probe_batch(table, recv_left, right_data0, right_data1, sink);
+            continue;
+        }
+        for (size_t i = 0; i < recv_left.size(); i++)
+            left_spill->add(spill_partition(recv_left[i], n_partitions), recv_left[i]);
+    }
+    if (!left_spill)
+        return;
+
+    // Spilled: join the partition pairs one at a time
+    left_spill->finish();
+    for (int f = 0; f < n_partitions; f++)
+        join_spill_partition(*right_spill, *left_spill, f, 0, budget_rows, table, sink);
+}
+
+// COLUMN FILES
+
+// A column file holds one column of a whole table: a 64 byte header, the
+// values in native byte order, and a footer with the min/max of the column
+// (so e.g. the key range is known without a pass over the data).
+//   header: magic "JOINCOL\0", version, dtype, value bytes, reserved, rows, data offset, padding
+//   data:   rows values, starting at the data offset
+//   footer: min, max (8 bytes each, a value of the dtype stored in the low bytes), rows, magic "JOINEND\0"
+static const char COLUMN_MAGIC[8] = {'J', 'O', 'I', 'N', 'C', 'O', 'L', '\0'};
+static const char COLUMN_END_MAGIC[8] = {'J', 'O', 'I', 'N', 'E', 'N', 'D', '\0'};
+static const uint32_t COLUMN_VERSION = 1;
+
+// bytes per MPI-IO call, keeps the counts in an int
+static const int64_t COLUMN_IO_BYTES = int64_t(1) << 30;
+
+struct ColumnHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t dtype;
+    uint32_t value_bytes;
+    uint32_t reserved;
+    int64_t rows;
+    int64_t data_offset;
+    char padding[24];
+};
+
+struct ColumnFooter {
+    char min[8];
+    char max[8];
+    int64_t rows;
+    char magic[8];
+};
+
+static_assert(sizeof(ColumnHeader) == 64, "column file header must be 64 bytes");
+static_assert(sizeof(ColumnFooter) == 32, "column file footer must be 32 bytes");
+
+/**
+ * @brief dtype code of a column file value type.
+ */
+template <typename T>
+struct ColumnType;
+
+template <>
+struct ColumnType<int> {
+    static const uint32_t dtype = 1;
+};
+
+template <>
+struct ColumnType<int64_t> {
+    static const uint32_t dtype = 2;
+};
+
+template <>
+struct ColumnType<float> {
+    static const uint32_t dtype = 3;
+};
+
+template <>
+struct ColumnType<double> {
+    static const uint32_t dtype = 4;
+};
+
+/**
+ * @brief Size and footer statistics of a column file (min and max are only
+ * meaningful if rows > 0).
+ */
+template <typename T>
+struct ColumnInfo {
+    int64_t rows;
+    T min;
+    T max;
+};
+
+/**
+ * @brief Abort the job because a column file is unusable.
+ */
+static void column_file_error(const std::string &path, const char *what)
+{
+    std::cerr << "Rank " << rank << ": " << path << ": " << what << std::endl;
+    MPI_Abort(MPI_COMM_WORLD, 1);
+}
+
+/**
+ * @brief Check the header and footer of a column file of `file_bytes` bytes
+ * holding values of type T, and return its size and statistics.
+ */
+template <typename T>
+static ColumnInfo<T> check_column_file(const std::string &path, const ColumnHeader &header,
+                                       const ColumnFooter &footer, int64_t file_bytes)
+{
+    static_assert(sizeof(T) <= 8, "column file values are at most 8 bytes");
+    if (memcmp(header.magic, COLUMN_MAGIC, sizeof(COLUMN_MAGIC)) != 0 || header.version != COLUMN_VERSION)
+        column_file_error(path, "not a column file");
+    if (header.dtype != ColumnType<T>::dtype || header.value_bytes != sizeof(T))
+        column_file_error(path, "column has a different value type");
+    if (header.rows < 0 || header.data_offset < (int64_t)sizeof(ColumnHeader) ||
+        file_bytes != header.data_offset + header.rows * (int64_t)sizeof(T) + (int64_t)sizeof(ColumnFooter) ||
+        memcmp(footer.magic, COLUMN_END_MAGIC, sizeof(COLUMN_END_MAGIC)) != 0 || footer.rows != header.rows)
+        column_file_error(path, "truncated or corrupt column file");
+    ColumnInfo<T> info;
+    info.rows = header.rows;
+    memcpy(&info.min, footer.min, sizeof(T));
+    memcpy(&info.max, footer.max, sizeof(T));
+    return info;
+}
+
+/**
+ * @brief Read-only memory mapping of this rank's chunk of a column file (see
+ * get_start). Only the pages of the chunk are mapped, and data() points into
+ * the page cache, so nothing is copied until the values are used.
+ * Aborts the job if the file is not a column file of type T.
+ */
+template <typename T>
+class MappedColumn
+{
+public:
+    explicit MappedColumn(const std::string &path)
+        : map_(NULL), map_bytes_(0), data_(NULL), size_(0)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0)
+            column_file_error(path, "cannot open");
+        ColumnHeader header;
+        ColumnFooter footer;
+        if (st.st_size < (off_t)(sizeof(header) + sizeof(footer)) ||
+            pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+            pread(fd, &footer, sizeof(footer), st.st_size - sizeof(footer)) != (ssize_t)sizeof(footer))
+            column_file_error(path, "not a column file");
+        info_ = check_column_file<T>(path, header, footer, st.st_size);
+
+        begin_ = get_start(info_.rows, n_pes, rank);
+        size_ = get_end(info_.rows, n_pes, rank) - begin_;
+        if (size_ > 0) {
+            // mmap offsets must be page aligned
+            int64_t offset = header.data_offset + begin_ * (int64_t)sizeof(T);
+            int64_t map_offset = offset & ~(int64_t(sysconf(_SC_PAGESIZE)) - 1);
+            map_bytes_ = offset + size_ * sizeof(T) - map_offset;
+            map_ = mmap(NULL, map_bytes_, PROT_READ, MAP_PRIVATE, fd, map_offset);
+            if (map_ == MAP_FAILED)
+                column_file_error(path, "cannot map");
+            madvise(map_, map_bytes_, MADV_SEQUENTIAL);
+            data_ = reinterpret_cast<const T *>(static_cast<const char *>(map_) + (offset - map_offset));
+        }
+        close(fd);
+    }
+
+    ~MappedColumn()
+    {
+        if (map_ != NULL)
+            munmap(map_, map_bytes_);
+    }
+
+    MappedColumn(const MappedColumn &) = delete;
+    MappedColumn &operator=(const MappedColumn &) = delete;
+
+    /** @brief Values of this rank's chunk. */
+    const T *data() const { return data_; }
+    /** @brief Number of rows in this rank's chunk. */
+    int64_t size() const { return size_; }
+    /** @brief Global row index of the first row of this rank's chunk. */
+    int64_t begin() const { return begin_; }
+    /** @brief Size and statistics of the whole column. */
+    const ColumnInfo<T> &info() const { return info_; }
+
+private:
+    void *map_;
+    size_t map_bytes_;
+    const T *data_;
+    int64_t begin_;
+    int64_t size_;
+    ColumnInfo<T> info_;
+};
+
+/**
+ * @brief Collective read of this rank's chunk of a column file (see
+ * get_start) with MPI-IO, straight into `col`. Every rank must call it.
+ * Aborts the job if the file is not a column file of type T.
+ *
+ * @param path Column file
+ * @param[out] col This rank's chunk of the column
+ * @return ColumnInfo<T> Size and statistics of the whole column
+ */
+template <typename T>
+ColumnInfo<T> read_column(const std::string &path, std::vector<T> &col)
+{
+    MPI_File file;
+    if (MPI_File_open(MPI_COMM_WORLD, path.c_str(), MPI_MODE_RDONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS)
+        column_file_error(path, "cannot open");
+    MPI_Offset file_bytes = 0;
+    MPI_File_get_size(file, &file_bytes);
+    ColumnHeader header;
+    ColumnFooter footer;
+    memset(&header, 0, sizeof(header));
+    memset(&footer, 0, sizeof(footer));
+    if (file_bytes >= (MPI_Offset)(sizeof(header) + sizeof(footer))) {
+        MPI_File_read_at_all(file, 0, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE);
+        MPI_File_read_at_all(file, file_bytes - sizeof(footer), &footer, sizeof(footer), MPI_BYTE,
+                             MPI_STATUS_IGNORE);
+    }
+    ColumnInfo<T> info = check_column_file<T>(path, header, footer, file_bytes);
+
+    int64_t begin = get_start(info.rows, n_pes, rank);
+    col.resize(get_end(info.rows, n_pes, rank) - begin);
+    // Collective calls: every rank makes as many as rank 0, which has the largest chunk
+    const int64_t chunk_rows = COLUMN_IO_BYTES / sizeof(T);
+    int64_t max_rows = get_node_portion(info.rows, n_pes, 0);
+    for (int64_t done = 0; done < max_rows; done += chunk_rows) {
+        int64_t n = std::max<int64_t>(0, std::min<int64_t>(chunk_rows, (int64_t)col.size() - done));
+        MPI_File_read_at_all(file, header.data_offset + (begin + done) * (int64_t)sizeof(T),
+                             col.data() + (n > 0 ? done : 0), n * sizeof(T), MPI_BYTE, MPI_STATUS_IGNORE);
+    }
+    MPI_File_close(&file);
+    return info;
+}
+
+/**
+ * @brief Collective write of a distributed column (the chunks of all ranks,
+ * in rank order) as one column file with MPI-IO. Every rank must call it.
+ * An existing file is replaced.
+ *
+ * @param path Column file
+ * @param col This rank's chunk of the column
+ * @return ColumnInfo<T> Size and statistics of the whole column
+ */
+template <typename T>
+ColumnInfo<T> write_column(const std::string &path, const std::vector<T> &col)
+{
+    // Statistics of every chunk, combined on all ranks (there are few ranks compared to rows)
+    std::vector<int64_t> offsets = global_row_offsets(col.size());
+    T local[2] = {T(), T()};
+    if (!col.empty()) {
+        auto minmax = std::minmax_element(col.begin(), col.end());
+        local[0] = *minmax.first;
+        local[1] = *minmax.second;
+    }
+    std::vector<T> chunk_stats(2 * n_pes);
+    MPI_Allgather(local, 2 * sizeof(T), MPI_BYTE, chunk_stats.data(), 2 * sizeof(T), MPI_BYTE, MPI_COMM_WORLD);
+    ColumnInfo<T> info = {offsets[n_pes], T(), T()};
+    bool first = true;
+    for (int p = 0; p < n_pes; p++) {
+        if (offsets[p + 1] == offsets[p])
+            continue;
+        info.min = first ? chunk_stats[2 * p] : std::min(info.min, chunk_stats[2 * p]);
+        info.max = first ? chunk_stats[2 * p + 1] : std::max(info.max, chunk_stats[2 * p + 1]);
+        first = false;
+    }
+
+    MPI_File file;
+    if (MPI_File_open(MPI_COMM_WORLD, path.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file) !=
+        MPI_SUCCESS)
+        column_file_error(path, "cannot create");
+    const int64_t data_offset = sizeof(ColumnHeader);
+    const int64_t data_end = data_offset + info.rows * (int64_t)sizeof(T);
+    MPI_File_set_size(file, data_end + sizeof(ColumnFooter));
+    if (rank == 0) {
+        ColumnHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, COLUMN_MAGIC, sizeof(COLUMN_MAGIC));
+        header.version = COLUMN_VERSION;
+        header.dtype = ColumnType<T>::dtype;
+        header.value_bytes = sizeof(T);
+        header.rows = info.rows;
+        header.data_offset = data_offset;
+        ColumnFooter footer;
+        memset(&footer, 0, sizeof(footer));
+        memcpy(footer.min, &info.min, sizeof(T));
+        memcpy(footer.max, &info.max, sizeof(T));
+        footer.rows = info.rows;
+        memcpy(footer.magic, COLUMN_END_MAGIC, sizeof(COLUMN_END_MAGIC));
+        MPI_File_write_at(file, 0, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE);
+        MPI_File_write_at(file, data_end, &footer, sizeof(footer), MPI_BYTE, MPI_STATUS_IGNORE);
+    }
+
+    // Collective calls: every rank makes as many as the rank with the largest chunk
+    const int64_t chunk_rows = COLUMN_IO_BYTES / sizeof(T);
+    int64_t max_rows = 0;
+    for (int p = 0; p < n_pes; p++)
+        max_rows = std::max(max_rows, offsets[p + 1] - offsets[p]);
+    for (int64_t done = 0; done < max_rows; done += chunk_rows) {
+        int64_t n = std::max<int64_t>(0, std::min<int64_t>(chunk_rows, (int64_t)col.size() - done));
+        MPI_File_write_at_all(file, data_offset + (offsets[rank] + done) * (int64_t)sizeof(T),
+                              col.data() + (n > 0 ? done : 0), n * sizeof(T), MPI_BYTE, MPI_STATUS_IGNORE);
+    }
+    MPI_File_close(&file);
+    return info;
+}
+
+/**
+ * @brief Source over this rank's chunk of a left table stored as a column
+ * file (see MappedColumn).
+ */
+LeftBatchSource column_left_source(const std::string &keys_path)
+{
+    std::shared_ptr<MappedColumn<int> > keys(new MappedColumn<int>(keys_path));
+    std::shared_ptr<int64_t> cursor(new int64_t(0));
+    return [keys, cursor](int64_t max_rows, std::vector<int> &batch) -> int64_t {
+        int64_t n = std::min(max_rows, keys->size() - *cursor);
+        read_batch(keys->data(), *cursor, n, batch);
+        *cursor += n;
+        return n;
+    };
+}
+
+/**
+ * @brief Source over this rank's chunk of a right table stored as one
+ * column file per column (see MappedColumn). Aborts the job if the columns
+ * differ in length.
+ */
+RightBatchSource column_right_source(const std::string &keys_path, const std::string &data0_path,
+                                     const std::string &data1_path)
 {
-    return local_join_impl(keys1, keys2, data0, data1);
+    std::shared_ptr<MappedColumn<int> > keys(new MappedColumn<int>(keys_path));
+    std::shared_ptr<MappedColumn<double> > data0(new MappedColumn<double>(data0_path));
+    std::shared_ptr<MappedColumn<int> > data1(new MappedColumn<int>(data1_path));
+    if (data0->info().rows != keys->info().rows || data1->info().rows != keys->info().rows)
+        column_file_error(keys_path, "columns of the table differ in length");
+    std::shared_ptr<int64_t> cursor(new int64_t(0));
+    return [keys, data0, data1, cursor](int64_t max_rows, std::vector<int> &batch_keys,
+                                        std::vector<double> &batch_data0, std::vector<int> &batch_data1) -> int64_t {
+        int64_t n = std::min(max_rows, keys->size() - *cursor);
+        read_batch(keys->data(), *cursor, n, batch_keys);
+        read_batch(data0->data(), *cursor, n, batch_data0);
+        read_batch(data1->data(), *cursor, n, batch_data1);
+        *cursor += n;
+        return n;
+    };
 }
 
 // DRIVER FUNCTION
 
+// bench.cpp includes this file with its own main()
+#ifndef JOIN_BENCHMARK
 int main()
 {
-    MPI_Init(NULL, NULL);
+    // Join threads never call MPI themselves
+    int thread_support;
+    MPI_Init_thread(NULL, NULL, MPI_THREAD_FUNNELED, &thread_support);
     MPI_Comm_size(MPI_COMM_WORLD, &n_pes);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    load_join_config();
+    if (thread_support < MPI_THREAD_FUNNELED)
+        join_config.threads = 1;
 
     // Join data buffers
     std::vector<int> k2;
@@ -94,6 +5039,15 @@ int main()
     // Use for testing with random inputs
     // generate_random_inputs(k1, k2, d1, d2, rank, n_pes);
 
+    // Use for testing with large generated inputs (sizes, key distribution, see GeneratorConfig)
+    // generate_inputs(GeneratorConfig(), k1, k2, d1, d2, rank, n_pes);
+
+    // Use for testing with tables stored as column files (see write_column)
+    // read_column("keys1.col", k1);
+    // read_column("keys2.col", k2);
+    // read_column("data0.col", d1);
+    // read_column("data1.col", d2);
+
     MPI_Barrier(MPI_COMM_WORLD);
 
     // Sleep for clearer stdout
@@ -120,12 +5074,43 @@ int main()
     std::vector<double> o1;
     std::vector<int> o2;
 
-    // Perform join
-    std::tuple<std::vector<int>, std::vector<double>, std::vector<int>> join_output = parallel_join_impl(k1, k2, d1, d2);
+    // Perform join, writing straight into the output buffers
+    parallel_join_into(k1, k2, d1, d2, o_keys, o1, o2);
+
+    // Or use one of the following instead of the join above
+    // (the results should match it):
+
+    // Use for joining any payload columns (see parallel_join_columns)
+    // std::tie(o_keys, o1, o2) = parallel_join_columns(k1, k2, d1, d2);
+
+    // Use for joining the row ids only, then fetching the payload (see parallel_join_indices)
+    // std::vector<int64_t> right_ids = std::get<1>(parallel_join_indices(k1, k2, false));
+    // o_keys = fetch_column(k2, right_ids);
+    // o1 = fetch_column(d1, right_ids);
+    // o2 = fetch_column(d2, right_ids);
 
-    o_keys = std::get<0>(join_output);
-    o1 = std::get<1>(join_output);
-    o2 = std::get<2>(join_output);
+    // Use for joining the inputs batch by batch, with bounded memory (see streaming_join),
+    // from the vectors or straight from column files (keep only one of the two calls)
+    // OutputSink append_output = [&](const std::vector<int> &keys, const std::vector<double> &data0,
+    //                                const std::vector<int> &data1) {
+    //     o_keys.insert(o_keys.end(), keys.begin(), keys.end());
+    //     o1.insert(o1.end(), data0.begin(), data0.end());
+    //     o2.insert(o2.end(), data1.begin(), data1.end());
+    // };
+    // streaming_join(vector_left_source(k1), vector_right_source(k2, d1, d2), append_output);
+    // streaming_join(column_left_source("keys1.col"),
+    //                column_right_source("keys2.col", "data0.col", "data1.col"), append_output);
+
+    // Use for counting the output rows only, without materializing them (see parallel_join_count)
+    // int64_t output_rows = parallel_join_count(k1, k2);
+    // if (rank == 0)
+    //     std::cout << "Output rows: " << output_rows << std::endl;
+
+    // Use for grouping the output by key while joining (see parallel_join_aggregate)
+    // std::vector<JoinAggregate> groups = parallel_join_aggregate(k1, k2, d1, d2);
+    // for (size_t i = 0; i < groups.size(); i++)
+    //     printf("Rank %d: key %d, %lld rows, data0 sum %f, data1 sum %lld\n", rank, groups[i].key,
+    //            (long long)groups[i].count, groups[i].sum0, (long long)groups[i].sum1);
 
     // Sleep for clearer stdout
     sleep(rank);
@@ -135,5 +5120,16 @@ int main()
         printf("| %3s | %9s | %5s |\n", std::to_string(o_keys[i]).c_str(), std::to_string(o1[i]).c_str(), std::to_string(o2[i]).c_str());
     }
     MPI_Barrier(MPI_COMM_WORLD);
+
+    // Use to keep the output as column files
+    // write_column("out_keys.col", o_keys);
+    // write_column("out_data0.col", o1);
+    // write_column("out_data1.col", o2);
+
+    // Counters and trace of the join (JOIN_STATS builds only)
+    print_join_stats(stderr);
+    write_join_trace();
+    release_node_shuffle();
     MPI_Finalize();
 }
+#endif
@@ -4,8 +4,16 @@ NUM_CORES=${1:-1}
 
 # Compile and link
 # g++ -fPIC -std=c++11 -I$CONDA_PREFIX/include helpers.hpp main.cpp -L$CONDA_PREFIX/lib -lmpi -o main.out
-mpic++ -fPIC -std=c++11 main.cpp -o main.out
+mpic++ -fPIC -std=c++11 -pthread main.cpp -o main.out
+# Benchmark driver, see bench.cpp for its options
+mpic++ -fPIC -std=c++11 -pthread bench.cpp -o bench.out
 
 # Run
 # mpiexec -n $NUM_CORES ./main.out
 
+# Benchmark: sweep the rank counts, appending to one CSV
+# for p in 1 2 4 8; do BENCH_OUTPUT=bench.csv mpiexec -n $p ./bench.out; done
+
+# Streaming join over a skewed key: the hot spill partitions are over the budget,
+# so they are split again and then joined in budget-sized chunks (compare output_rows with impl)
+# for api in impl stream; do BENCH_API=$api BENCH_ROWS=100000 BENCH_DIST=zipf BENCH_ZIPF_S=1.1 JOIN_MEMORY_BUDGET=65536 JOIN_SPILL_PARTITIONS=4 mpiexec -n 4 ./bench.out; done